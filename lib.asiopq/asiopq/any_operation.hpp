@@ -0,0 +1 @@
+#include "layer3/any_operation.hpp"
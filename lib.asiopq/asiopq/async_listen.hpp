@@ -0,0 +1 @@
+#include "layer2/async_listen.hpp"
@@ -0,0 +1 @@
+#include "layer4/auto_pipeline.hpp"
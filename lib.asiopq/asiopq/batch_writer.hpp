@@ -0,0 +1 @@
+#include "layer4/batch_writer.hpp"
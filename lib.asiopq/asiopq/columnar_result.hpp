@@ -0,0 +1 @@
+#include "layer3/columnar_result.hpp"
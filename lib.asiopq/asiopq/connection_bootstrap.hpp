@@ -0,0 +1 @@
+#include "layer3/connection_bootstrap.hpp"
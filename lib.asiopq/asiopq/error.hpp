@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+#include <cstring>
 #include <type_traits>
 #include <boost/system/error_code.hpp>
 #include <libpq-fe.h>
@@ -20,7 +22,12 @@ enum class PQError : int
     SEND_QUERY_PREPARED_FAILED,
     SEND_PREPARE_FAILED,
     RESULT_FATAL_ERROR,
-    RESULT_BAD_RESPONSE
+    RESULT_BAD_RESPONSE,
+    RESULT_SCHEMA_MISMATCH,
+    PIPELINE_FAILED,
+    TRANSACTION_ABORTED,
+    CIRCUIT_OPEN,
+    COPY_DATA_FAILED
 };
 
 class PQErrorCategory
@@ -60,6 +67,16 @@ public:
             return "PostgreSQL PQresultStatus: PGRES_FATAL_ERROR";
         case PQError::RESULT_BAD_RESPONSE:
             return "PostgreSQL PQresultStatus: PGRES_BAD_RESPONSE";
+        case PQError::RESULT_SCHEMA_MISMATCH:
+            return "PostgreSQL result columns differ from previous result";
+        case PQError::PIPELINE_FAILED:
+            return "PostgreSQL pipeline mode command failed";
+        case PQError::TRANSACTION_ABORTED:
+            return "PostgreSQL transaction aborted and rolled back";
+        case PQError::CIRCUIT_OPEN:
+            return "PostgreSQL server unavailable, reconnection circuit is open";
+        case PQError::COPY_DATA_FAILED:
+            return "PostgreSQL COPY data exchange failed";
         default:
             assert(!"Unexpected PQError value");
             return "Unknown PostgreSQL error";
@@ -83,6 +100,170 @@ inline boost::system::error_condition make_error_condition(PQError e)
     return boost::system::error_condition{ static_cast<int>(e), pqcategory() };
 }
 
+// Ошибки сервера с кодом SQLSTATE: значение - пять символов кода в 36-ричной записи.
+// Такая ошибка равна условию make_error_condition(PQError::RESULT_FATAL_ERROR), которое раньше было ее кодом,
+// и, для совместимости, самому PQError::RESULT_FATAL_ERROR (см. operator== в конце файла).
+class SqlStateCategory
+    : public boost::system::error_category
+{
+public:
+    const char* name() const noexcept override
+    {
+        return "PostgreSQL SQLSTATE";
+    }
+
+    std::string message(int ev) const override
+    {
+        return "PostgreSQL error, SQLSTATE " + decode(ev);
+    }
+
+    bool equivalent(int, const boost::system::error_condition& condition) const noexcept override
+    {
+        return condition == make_error_condition(PQError::RESULT_FATAL_ERROR);
+    }
+
+    static int encode(const char* sqlState) noexcept
+    {
+        int value = 0;
+        for (int i = 0; i < 5; ++i)
+        {
+            const char c = sqlState[i];
+            if (c >= '0' && c <= '9')
+                value = value * 36 + (c - '0');
+            else if (c >= 'A' && c <= 'Z')
+                value = value * 36 + (c - 'A' + 10);
+            else
+                return -1;
+        }
+        return value;
+    }
+
+    static std::string decode(int value)
+    {
+        std::string sqlState(5, '0');
+        for (int i = 4; i >= 0; --i, value /= 36)
+        {
+            const int digit = value % 36;
+            sqlState[i] = char(digit < 10 ? '0' + digit : 'A' + digit - 10);
+        }
+        return sqlState;
+    }
+};
+
+inline const boost::system::error_category& sqlstatecategory()
+{
+    static SqlStateCategory instance;
+    return instance;
+}
+
+// код ошибки по SQLSTATE, при неверном коде - PQError::RESULT_FATAL_ERROR
+inline boost::system::error_code makeSqlStateErrorCode(const char* sqlState)
+{
+    const int value = sqlState && 5 == std::strlen(sqlState) ? SqlStateCategory::encode(sqlState) : -1;
+    if (value < 0)
+        return make_error_code(PQError::RESULT_FATAL_ERROR);
+
+    return boost::system::error_code{ value, sqlstatecategory() };
+}
+
+// SQLSTATE ошибки сервера, пустая строка для остальных ошибок
+inline std::string sqlState(const boost::system::error_code& ec)
+{
+    if (ec.category() != sqlstatecategory())
+        return {};
+
+    return SqlStateCategory::decode(ec.value());
+}
+
+// ошибка результата PGRES_FATAL_ERROR с его SQLSTATE
+inline boost::system::error_code resultErrorCode(const ::PGresult* res)
+{
+    return makeSqlStateErrorCode(::PQresultErrorField(res, PG_DIAG_SQLSTATE));
+}
+
+// Классы ошибок для решения, повторять ли операцию: if (ErrorClass::TRANSIENT == ec) ...
+enum class ErrorClass : int
+{
+    TRANSIENT = 1, // конфликт сериализации, взаимоблокировка, обрыв или перегрузка сервера - повтор может пройти
+    CONSTRAINT,    // нарушение ограничения целостности (класс 23) - повтор не поможет, ошибка в данных
+    FATAL          // остальные ошибки сервера и библиотеки
+};
+
+class ErrorClassCategory
+    : public boost::system::error_category
+{
+public:
+    const char* name() const noexcept override
+    {
+        return "PostgreSQL error class";
+    }
+
+    std::string message(int ev) const override
+    {
+        switch (ErrorClass(ev))
+        {
+        case ErrorClass::TRANSIENT:
+            return "PostgreSQL transient error";
+        case ErrorClass::CONSTRAINT:
+            return "PostgreSQL integrity constraint violation";
+        case ErrorClass::FATAL:
+            return "PostgreSQL fatal error";
+        default:
+            return "Unknown PostgreSQL error class";
+        }
+    }
+
+    bool equivalent(const boost::system::error_code& ec, int condition) const noexcept override
+    {
+        return ec && int(classify(ec)) == condition;
+    }
+
+    static ErrorClass classify(const boost::system::error_code& ec) noexcept
+    {
+        if (ec.category() == pqcategory())
+        {
+            switch (PQError(ec.value()))
+            {
+            case PQError::CONN_FAILED:
+            case PQError::CONN_POLL_FAILED:
+            case PQError::CONSUME_INPUT_FAILED:
+                return ErrorClass::TRANSIENT;
+            default:
+                return ErrorClass::FATAL;
+            }
+        }
+
+        if (ec.category() != sqlstatecategory())
+            return ErrorClass::FATAL;
+
+        const std::string code = SqlStateCategory::decode(ec.value());
+        if ("40001" == code // serialization_failure
+            || "40P01" == code // deadlock_detected
+            || "55P03" == code // lock_not_available
+            || "53300" == code // too_many_connections
+            || "57P01" == code // admin_shutdown
+            || "57P03" == code // cannot_connect_now
+            || 0 == code.compare(0, 2, "08")) // connection_exception
+            return ErrorClass::TRANSIENT;
+
+        if (0 == code.compare(0, 2, "23")) // integrity_constraint_violation
+            return ErrorClass::CONSTRAINT;
+
+        return ErrorClass::FATAL;
+    }
+};
+
+inline const boost::system::error_category& errorclasscategory()
+{
+    static ErrorClassCategory instance;
+    return instance;
+}
+
+inline boost::system::error_condition make_error_condition(ErrorClass e)
+{
+    return boost::system::error_condition{ static_cast<int>(e), errorclasscategory() };
+}
+
 } // namespace asiopq
 } // namespace ba
 
@@ -95,5 +276,43 @@ struct is_error_code_enum<ba::asiopq::PQError>
 {
 };
 
+template<>
+struct is_error_condition_enum<ba::asiopq::ErrorClass>
+    : std::true_type
+{
+};
+
 } // namespace system
 } // namespace boost
+
+namespace ba {
+namespace asiopq {
+
+// Раньше ошибки сервера приходили кодом PQError::RESULT_FATAL_ERROR, сравнение PQError::RESULT_FATAL_ERROR == ec
+// остается истинным и для кода с SQLSTATE. Нешаблонные перегрузки точнее сравнений из boost::system,
+// объявлены после is_error_code_enum, которую те проверяют.
+inline bool operator==(PQError e, const boost::system::error_code& ec) noexcept
+{
+    if (PQError::RESULT_FATAL_ERROR == e && ec.category() == sqlstatecategory())
+        return true;
+
+    return make_error_code(e) == ec;
+}
+
+inline bool operator==(const boost::system::error_code& ec, PQError e) noexcept
+{
+    return e == ec;
+}
+
+inline bool operator!=(PQError e, const boost::system::error_code& ec) noexcept
+{
+    return !(e == ec);
+}
+
+inline bool operator!=(const boost::system::error_code& ec, PQError e) noexcept
+{
+    return !(e == ec);
+}
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1 @@
+#include "layer1/flight_recorder.hpp"
@@ -0,0 +1 @@
+#include "layer4/hedged_pool.hpp"
@@ -0,0 +1 @@
+#include "layer3/host_resolver.hpp"
@@ -0,0 +1,474 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/detail/handler_alloc_helpers.hpp>
+#include <boost/asio/detail/handler_cont_helpers.hpp>
+#include <boost/asio/detail/handler_invoke_helpers.hpp>
+
+#include <libpq-fe.h>
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+#endif
+
+namespace ba {
+namespace asiopq {
+
+namespace detail {
+
+class CancellationState
+{
+public:
+    void emit()
+    {
+        std::function<void()> handler;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_cancelled = true;
+            handler = std::move(m_handler);
+            m_handler = nullptr;
+        }
+
+        if (handler)
+            handler();
+    }
+
+    void assign(std::function<void()> handler)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            if (!m_cancelled)
+            {
+                m_handler = std::move(handler);
+                return;
+            }
+        }
+
+        handler(); // отмена пришла раньше операции
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_handler = nullptr;
+    }
+
+    bool cancelled()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return m_cancelled;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::function<void()> m_handler;
+    bool m_cancelled = false;
+};
+
+} // namespace detail
+
+// Сторона операции: операция ставит в слот свой обработчик отмены на время выполнения.
+// Пустой слот (по умолчанию) означает, что отмена не нужна, и ничего не стоит.
+class CancellationSlot
+{
+public:
+    CancellationSlot() = default;
+
+    bool connected() const noexcept
+    {
+        return bool(m_state);
+    }
+
+    // если отмена уже запрошена, handler вызывается сразу
+    void assign(std::function<void()> handler) const
+    {
+        if (m_state)
+            m_state->assign(std::move(handler));
+    }
+
+    void clear() const
+    {
+        if (m_state)
+            m_state->clear();
+    }
+
+    bool cancelled() const
+    {
+        return m_state && m_state->cancelled();
+    }
+
+private:
+    friend class CancellationSignal;
+
+    explicit CancellationSlot(std::shared_ptr<detail::CancellationState> state)
+        : m_state{ std::move(state) }
+    {
+    }
+
+private:
+    std::shared_ptr<detail::CancellationState> m_state;
+};
+
+// Сторона вызывающего. В отличие от слотов asio (boost >= 1.77) потокобезопасен:
+// emit можно вызывать из любого потока, в том числе раньше запуска операции.
+// Один сигнал - одна операция.
+class CancellationSignal
+{
+public:
+    CancellationSignal()
+        : m_state{ std::make_shared<detail::CancellationState>() }
+    {
+    }
+
+    void emit()
+    {
+        m_state->emit();
+    }
+
+    CancellationSlot slot() const
+    {
+        return CancellationSlot{ m_state };
+    }
+
+private:
+    std::shared_ptr<detail::CancellationState> m_state;
+};
+
+// Хендлер со слотом отмены. Connection::asyncExec, а значит и все функции layer2, находят слот в хендлере,
+// при отмене отправляют серверу запрос отмены, а хендлер получает boost::asio::error::operation_aborted.
+template <typename Handler>
+class CancellationBinder
+{
+public:
+    CancellationBinder(CancellationSlot slot, Handler handler)
+        : m_slot{ std::move(slot) }
+        , m_handler{ std::move(handler) }
+    {
+    }
+
+    // для async_result_init: хендлер конструируется из токена
+    template <typename OtherHandler>
+    CancellationBinder(CancellationBinder<OtherHandler>&& other)
+        : m_slot{ std::move(other.slot()) }
+        , m_handler{ std::move(other.handler()) }
+    {
+    }
+
+    template <typename... Args>
+    void operator()(boost::system::error_code ec, Args&&... args)
+    {
+        m_slot.clear();
+        if (ec && m_slot.cancelled())
+            ec = boost::asio::error::operation_aborted;
+
+        m_handler(ec, std::forward<Args>(args)...);
+    }
+
+    CancellationSlot& slot() noexcept
+    {
+        return m_slot;
+    }
+
+    Handler& handler() noexcept
+    {
+        return m_handler;
+    }
+
+private:
+    CancellationSlot m_slot;
+    Handler m_handler;
+};
+
+template <typename Handler>
+CancellationBinder<std::decay_t<Handler>> bindCancellationSlot(CancellationSlot slot, Handler&& handler)
+{
+    return { std::move(slot), std::forward<Handler>(handler) };
+}
+
+// хуки asio пробрасываются к исходному хендлеру, как это делают обертки самой asio
+template <typename Handler>
+void* asio_handler_allocate(std::size_t size, CancellationBinder<Handler>* binder)
+{
+    return boost_asio_handler_alloc_helpers::allocate(size, binder->handler());
+}
+
+template <typename Handler>
+void asio_handler_deallocate(void* pointer, std::size_t size, CancellationBinder<Handler>* binder)
+{
+    boost_asio_handler_alloc_helpers::deallocate(pointer, size, binder->handler());
+}
+
+template <typename Handler>
+bool asio_handler_is_continuation(CancellationBinder<Handler>* binder)
+{
+    return boost_asio_handler_cont_helpers::is_continuation(binder->handler());
+}
+
+template <typename Function, typename Handler>
+void asio_handler_invoke(Function& function, CancellationBinder<Handler>* binder)
+{
+    boost_asio_handler_invoke_helpers::invoke(function, binder->handler());
+}
+
+template <typename Function, typename Handler>
+void asio_handler_invoke(const Function& function, CancellationBinder<Handler>* binder)
+{
+    boost_asio_handler_invoke_helpers::invoke(function, binder->handler());
+}
+
+namespace detail {
+
+// Ключ отмены серверного процесса соединения. Запрос отмены - отдельное подключение к серверу:
+// с PQcancelStart/PQcancelPoll (libpq 17+) оно ограничено сроком, старый PQcancel блокирует до таймаута TCP.
+class CancelKey
+{
+public:
+    CancelKey(const CancelKey&) = delete;
+    CancelKey& operator=(const CancelKey&) = delete;
+
+    explicit CancelKey(PGconn* conn)
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+        : m_cancel{ ::PQcancelCreate(conn) }
+#else
+        : m_cancel{ ::PQgetCancel(conn) }
+#endif
+    {
+    }
+
+    ~CancelKey()
+    {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+        ::PQcancelFinish(m_cancel);
+#else
+        ::PQfreeCancel(m_cancel);
+#endif
+    }
+
+    bool valid() const noexcept
+    {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+        return m_cancel && ::CONNECTION_BAD != ::PQcancelStatus(m_cancel);
+#else
+        return nullptr != m_cancel;
+#endif
+    }
+
+    // блокирует вызывающий поток, с PQcancelPoll - не дольше timeout
+    void send(std::chrono::milliseconds timeout)
+    {
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+        std::lock_guard<std::mutex> lock{ m_mutex }; // PGcancelConn ведет один запрос за раз
+        if (m_used)
+            ::PQcancelReset(m_cancel);
+        m_used = true;
+
+        if (!::PQcancelStart(m_cancel))
+            return;
+
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (;;)
+        {
+            const auto status = ::PQcancelPoll(m_cancel);
+            if (PGRES_POLLING_READING != status && PGRES_POLLING_WRITING != status)
+                return; // отправлен или не удался, отмена лишь просьба к серверу
+
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0)
+                return;
+
+            ::pollfd fd{};
+            fd.fd = ::PQcancelSocket(m_cancel);
+            fd.events = PGRES_POLLING_READING == status ? POLLIN : POLLOUT;
+#ifdef _WIN32
+            if (::WSAPoll(&fd, 1, int(left.count())) <= 0)
+#else
+            if (::poll(&fd, 1, int(left.count())) <= 0)
+#endif
+                return;
+        }
+#else
+        (void)timeout;
+        char errbuf[256];
+        ::PQcancel(m_cancel, errbuf, sizeof(errbuf));
+#endif
+    }
+
+private:
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    ::PGcancelConn* m_cancel;
+    std::mutex m_mutex;
+    bool m_used = false;
+#else
+    ::PGcancel* m_cancel;
+#endif
+};
+
+// Запросы отмены отправляют несколько служебных потоков: запрос блокирует поток на время подключения к серверу,
+// поток на каждую отмену при массовой отмене (проигравшие попытки HedgedPool, FIRST_ERROR в asyncWhenAll)
+// плодил бы потоки без ограничений, а один поток целиком вставал бы на недоступном сервере.
+// Очередь ограничена: отмена лишь просьба к серверу, лишние запросы отбрасываются и считаются (см. cancelRequestsDropped).
+class CancelWorker
+{
+public:
+    static constexpr std::size_t MAX_THREADS = 4;
+    static constexpr std::size_t MAX_PENDING = 256;
+    static constexpr std::chrono::milliseconds::rep TIMEOUT_MS = 5'000; // на подключение одного запроса
+
+    // Объект намеренно не удаляется, а потоки не присоединяются: PQcancel к недоступному серверу
+    // может блокировать долго, и завершение программы не должно его ждать
+    static CancelWorker& instance()
+    {
+        static CancelWorker* const worker = new CancelWorker;
+        return *worker;
+    }
+
+    // false - очередь переполнена, запрос отброшен
+    bool post(std::shared_ptr<CancelKey> cancel)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            if (m_queue.size() >= MAX_PENDING)
+            {
+                ++m_dropped;
+                return false;
+            }
+
+            m_queue.push_back(std::move(cancel));
+
+            // новый поток, только если все заняты: ими могут быть зависшие на недоступном сервере запросы
+            if (m_queue.size() > m_idle && m_threads < MAX_THREADS)
+            {
+                ++m_threads;
+                std::thread([this]() { run(); }).detach();
+            }
+        }
+
+        m_cv.notify_one();
+        return true;
+    }
+
+    std::size_t dropped() const noexcept
+    {
+        return m_dropped;
+    }
+
+private:
+    CancelWorker() = default;
+
+    void run()
+    {
+        for (;;)
+        {
+            std::shared_ptr<CancelKey> cancel;
+            {
+                std::unique_lock<std::mutex> lock{ m_mutex };
+                ++m_idle;
+                m_cv.wait(lock, [this]() { return !m_queue.empty(); });
+                --m_idle;
+                cancel = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            cancel->send(std::chrono::milliseconds{ std::chrono::milliseconds::rep{ TIMEOUT_MS } });
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<CancelKey>> m_queue;
+    std::size_t m_threads = 0;
+    std::size_t m_idle = 0; // потоков, ждущих запросы
+    std::atomic_size_t m_dropped{ 0 };
+};
+
+inline void sendCancelRequest(std::shared_ptr<CancelKey> cancel)
+{
+    CancelWorker::instance().post(std::move(cancel));
+}
+
+inline std::shared_ptr<CancelKey> makeCancel(PGconn* conn)
+{
+    if (!conn)
+        return {};
+
+    auto cancel = std::make_shared<CancelKey>(conn);
+    if (!cancel->valid())
+        return {};
+
+    return cancel;
+}
+
+// обычный хендлер отмену не поддерживает
+template <typename Handler>
+void assignCancellation(Handler&, const std::shared_ptr<CancelKey>&)
+{
+}
+
+// cancel - ключ отмены текущего серверного процесса соединения (см. Connection::cancelHandle)
+template <typename Handler>
+void assignCancellation(CancellationBinder<Handler>& handler, const std::shared_ptr<CancelKey>& cancel)
+{
+    if (!handler.slot().connected())
+        return;
+
+    handler.slot().assign([cancel]() {
+        if (cancel)
+            sendCancelRequest(cancel);
+    });
+}
+
+} // namespace detail
+
+// Сколько запросов отмены отброшено из-за переполненной очереди: сервер их не получил, операции завершатся сами
+inline std::size_t cancelRequestsDropped() noexcept
+{
+    return detail::CancelWorker::instance().dropped();
+}
+
+} // namespace asiopq
+} // namespace ba
+
+namespace boost {
+namespace asio {
+
+template <typename Handler, typename Signature>
+class async_result<ba::asiopq::CancellationBinder<Handler>, Signature>
+{
+public:
+    using completion_handler_type = ba::asiopq::CancellationBinder<
+        typename async_result<Handler, Signature>::completion_handler_type
+        >;
+    using return_type = typename async_result<Handler, Signature>::return_type;
+    using type = return_type;
+
+    explicit async_result(completion_handler_type& handler)
+        : m_inner{ handler.handler() }
+    {
+    }
+
+    return_type get()
+    {
+        return m_inner.get();
+    }
+
+private:
+    async_result<Handler, Signature> m_inner;
+};
+
+} // namespace asio
+} // namespace boost
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <cstdint>
 
 #include <libpq-fe.h>
 
@@ -9,7 +10,9 @@
 
 #include "detail/dup_socket.hpp"
 #include "detail/operations.hpp"
+#include "cancellation.hpp"
 #include "ignore_result.hpp"
+#include "notifications.hpp"
 
 namespace boost {
 namespace asio {
@@ -59,6 +62,7 @@ public:
     explicit Connection(boost::asio::io_service& ios)
         : m_conn{ nullptr, ::PQfinish }
         , m_socket{ std::make_unique<boost::asio::ip::tcp::socket>(ios) }
+        , m_notifications{ std::make_shared<detail::NotificationHub>() }
     {
     }
 
@@ -80,6 +84,11 @@ public:
         return m_conn.get();
     }
 
+    boost::asio::io_service& get_io_service() noexcept
+    {
+        return m_socket->get_io_service();
+    }
+
     template <typename ConnectHandler>
     auto asyncConnect(const char* conninfo, ConnectHandler&& handler)
     {
@@ -133,11 +142,158 @@ public:
         // );
         boost::asio::ba_asiopq_handlerCheck(handler);
 
+        return startExec(
+              std::forward<SendCmd>(cmd)
+            , 0
+            , std::forward<ExecHandler>(handler)
+            , std::forward<ResultCollector>(coll)
+            );
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    // Выполнение нескольких команд за один проход в режиме конвейера libpq.
+    // cmd должен перевести соединение в режим конвейера (PQenterPipelineMode), отправить команды
+    // и syncs точек синхронизации (PQpipelineSync). Коллектор получает результаты всех команд подряд,
+    // nullptr отделяет результаты очередной команды, сами PGRES_PIPELINE_SYNC коллектору не передаются.
+    // Операция завершается после последней точки синхронизации, соединение выводится из режима конвейера.
+    // Если cmd вернул ошибку, уже войдя в режим конвейера, соединение закрывается.
+    template <typename SendCmd, typename ExecHandler, typename ResultCollector = IgnoreResult>
+    auto asyncExecPipeline(SendCmd&& cmd, int syncs, ExecHandler&& handler, ResultCollector&& coll = {})
+    {
+        // If you get an error on the following line it means that your handler does
+        // not meet the documented type requirements for a ConnectHandler:
+        // void handler(
+        //     const boost::system::error_code & ec // Result of operation
+        // );
+        boost::asio::ba_asiopq_handlerCheck(handler);
+        assert(syncs > 0);
+
+        return startExec(
+              std::forward<SendCmd>(cmd)
+            , syncs
+            , std::forward<ExecHandler>(handler)
+            , std::forward<ResultCollector>(coll)
+            );
+    }
+#endif
+
+    // подписка на уведомления канала, сам LISTEN нужно выполнить отдельно (см. asyncListen),
+    // хендлер вызывается в потоке, который обслуживает соединение, и не должен блокировать
+    std::size_t subscribe(std::string channel, NotificationHandler handler)
+    {
+        return m_notifications->subscribe(std::move(channel), std::move(handler));
+    }
+
+    void unsubscribe(std::size_t subscription)
+    {
+        m_notifications->unsubscribe(subscription);
+    }
+
+    // Держит ожидание чтения на сокете, пока соединение простаивает, чтобы получать уведомления без запросов.
+    // Во время asyncExec уведомления разбирает сама операция.
+    // Хендлер ожидания исполняется в любом потоке io_service, с началом команды на соединении он сериализован.
+    // Сами вызовы методов Connection, как и прежде, не должны идти параллельно.
+    // После close() и переподключения нужно вызвать снова.
+    void startListening()
+    {
+        m_notifications->startListening(m_conn.get(), *m_socket);
+    }
+
+    void stopListening()
+    {
+        m_notifications->stopListening(*m_socket);
+    }
+
+    // Ожидание данных на сокете для протоколов, которые сами читают соединение после asyncExec
+    // (например, поток репликации в режиме COPY BOTH). Хендлер получает только ошибку сокета,
+    // данные забирает вызывающий через PQconsumeInput.
+    template <typename WaitHandler>
+    void asyncWaitReading(WaitHandler&& handler)
+    {
+        detail::asyncWaitReading(*m_socket, std::forward<WaitHandler>(handler));
+    }
+
+    // Ожидание готовности сокета к записи, когда вызывающий сам досылает данные на неблокирующем соединении
+    // (например, COPY FROM STDIN, см. BatchWriter)
+    template <typename WaitHandler>
+    void asyncWaitWriting(WaitHandler&& handler)
+    {
+        detail::asyncWaitWriting(*m_socket, std::forward<WaitHandler>(handler));
+    }
+
+    // Прерывает идущее подключение: сокет закрывается, хендлер подключения получит ошибку.
+    // PGconn остается жить до close() или деструктора, так как операция подключения еще ссылается на него
+    void cancelConnect() noexcept
+    {
+        boost::system::error_code ignoreEc;
+        m_socket->close(ignoreEc);
+    }
+
+    // Ключ отмены серверного процесса, которому соединение отправило последнюю команду: берется при первой
+    // команде после каждого подключения, поэтому после переподключения относится уже к новому процессу.
+    // Потокобезопасен, пул отменяет через него выполняющуюся операцию. Пусто - команд еще не было
+    std::shared_ptr<detail::CancelKey> cancelHandle() const
+    {
+        return std::atomic_load(&m_cancel);
+    }
+
+    // Номер подключения: меняется при каждом подключении и закрытии, в отличие от адреса PGconn,
+    // который после PQfinish аллокатор может выдать новому подключению снова
+    std::uint64_t generation() const noexcept
+    {
+        return m_generation;
+    }
+
+    // Забирает установленное подключение у other, собственные подписки на уведомления сохраняются.
+    // other остается закрытым
+    void adopt(Connection&& other) noexcept
+    {
+        close();
+        std::swap(m_conn, other.m_conn);
+        std::swap(m_socket, other.m_socket);
+        std::atomic_store(&m_cancel, std::atomic_exchange(&other.m_cancel, std::shared_ptr<detail::CancelKey>{}));
+        ++m_generation;
+        ++other.m_generation;
+    }
+
+    boost::system::error_code close() noexcept
+    {
+        boost::system::error_code ec;
+
+        m_notifications->stopListening(*m_socket);
+
+        if (m_socket->is_open())
+            m_socket->close(ec);
+
+        m_conn.reset();
+        std::atomic_store(&m_cancel, std::shared_ptr<detail::CancelKey>{});
+        ++m_generation;
+
+        return ec;
+    }
+
+private:
+    template <typename SendCmd, typename ExecHandler, typename ResultCollector>
+    auto startExec(SendCmd&& cmd, int pipelineSyncs, ExecHandler&& handler, ResultCollector&& coll)
+    {
         detail::async_result_init<ExecHandler, void(boost::system::error_code)>
             init{ std::forward<ExecHandler>(handler) };
 
+        if (!std::atomic_load(&m_cancel)) // первая команда после подключения
+            std::atomic_store(&m_cancel, detail::makeCancel(m_conn.get()));
+
+        detail::assignCancellation(init.handler, m_cancel); // хендлер из bindCancellationSlot
+        m_notifications->suspend(*m_socket);
         boost::system::error_code ec = cmd();
 
+#ifdef LIBPQ_HAS_PIPELINING
+        // Отправка оборвалась после входа в режим конвейера: на соединении остались результаты уже отправленных
+        // команд без точки синхронизации, обычные команды на нем больше не пройдут. Закрываем соединение,
+        // пул с переподключением увидит CONNECTION_BAD и заменит его
+        if (ec && 0 != pipelineSyncs && ::PQ_PIPELINE_OFF != ::PQpipelineStatus(m_conn.get()))
+            close();
+#endif
+
         using ExecOpType = detail::ExecOp<decltype(init.handler), ResultCollector>;
         // здесь разделено на 2 разных вызова: в случае ошибки ec уходит в капчу,
         // а в нормальном режиме идет экономия 16 байт за счет отсутствия ec в капче,
@@ -145,8 +301,8 @@ public:
         if (ec)
             m_socket->get_io_service().post(
                   [boundHandler{
-                      ExecOpType{ m_conn.get(), *m_socket, std::move(init.handler)
-                    , std::forward<ResultCollector>(coll) }
+                      ExecOpType{ m_conn.get(), *m_socket, m_notifications.get(), std::move(init.handler)
+                    , std::forward<ResultCollector>(coll), pipelineSyncs }
                     }
                 // Явное копирование ec в капче сделано намеренно. Если кто-то вдруг при рефакторинге кода объявит ec константой,
                 // то это выражение спасает от ситуации, когда вся лямбда потеряет move-конструктор, что могло бы снизить производительность.
@@ -157,8 +313,8 @@ public:
         else
             m_socket->get_io_service().post(
                 [boundHandler{
-                      ExecOpType{ m_conn.get(), *m_socket, std::move(init.handler)
-                    , std::forward<ResultCollector>(coll) }
+                      ExecOpType{ m_conn.get(), *m_socket, m_notifications.get(), std::move(init.handler)
+                    , std::forward<ResultCollector>(coll), pipelineSyncs }
                     }] () mutable {
                     boundHandler(boost::system::error_code{});
                     }
@@ -167,25 +323,16 @@ public:
         return init.result.get();
     }
 
-    boost::system::error_code close() noexcept
-    {
-        boost::system::error_code ec;
-
-        if (m_socket->is_open())
-            m_socket->close(ec);
-
-        m_conn.reset();
-
-        return ec;
-    }
-
-private:
     template <typename ConnectHandler>
     auto startConnectPoll(ConnectHandler&& handler)
     {
         detail::async_result_init<ConnectHandler, void(boost::system::error_code)>
             init{ std::forward<ConnectHandler>(handler) };
 
+        m_notifications->stopListening(*m_socket); // старое соединение заменено, его LISTEN на сервере уже не действуют
+        std::atomic_store(&m_cancel, std::shared_ptr<detail::CancelKey>{}); // как и ключ отмены
+        ++m_generation;
+
         boost::system::error_code ec;
         int nativeSocket = -1;
 
@@ -280,6 +427,9 @@ private:
 private:
     std::unique_ptr<PGconn, decltype(&::PQfinish)> m_conn;
     std::unique_ptr<boost::asio::ip::tcp::socket> m_socket;
+    std::shared_ptr<detail::NotificationHub> m_notifications;
+    std::shared_ptr<detail::CancelKey> m_cancel; // только через std::atomic_load/atomic_store, см. cancelHandle
+    std::uint64_t m_generation = 0;
 };
 
 } // namespace asiopq
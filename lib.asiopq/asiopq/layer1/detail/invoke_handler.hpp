@@ -0,0 +1,36 @@
+#pragma once
+
+#include <boost/asio/detail/bind_handler.hpp>
+#include <boost/asio/detail/handler_invoke_helpers.hpp>
+#include <boost/asio/version.hpp>
+
+namespace ba {
+namespace asiopq {
+namespace detail {
+
+// вызов хендлера с учетом его asio_handler_invoke, как это делают сами операции asio
+template <typename Handler, typename Arg1>
+void invokeHandler(Handler&& handler, const Arg1& arg1)
+{
+#if BOOST_ASIO_VERSION >= 101200
+    boost::asio::detail::binder1<std::decay_t<Handler>, Arg1> binder{ 0, std::forward<Handler>(handler), arg1 };
+#else
+    boost::asio::detail::binder1<std::decay_t<Handler>, Arg1> binder{ std::forward<Handler>(handler), arg1 };
+#endif
+    boost_asio_handler_invoke_helpers::invoke(binder, binder.handler_);
+}
+
+template <typename Handler, typename Arg1, typename Arg2>
+void invokeHandler(Handler&& handler, const Arg1& arg1, const Arg2& arg2)
+{
+#if BOOST_ASIO_VERSION >= 101200
+    boost::asio::detail::binder2<std::decay_t<Handler>, Arg1, Arg2> binder{ 0, std::forward<Handler>(handler), arg1, arg2 };
+#else
+    boost::asio::detail::binder2<std::decay_t<Handler>, Arg1, Arg2> binder{ std::forward<Handler>(handler), arg1, arg2 };
+#endif
+    boost_asio_handler_invoke_helpers::invoke(binder, binder.handler_);
+}
+
+} // namespace detail
+} // namespace asiopq
+} // namespace ba
@@ -12,6 +12,9 @@
 #include <libpq-fe.h>
 
 #include "async_wait_socket.hpp"
+#include "../notifications.hpp"
+#include "../result.hpp"
+#include "../flight_recorder.hpp"
 #include "../../error.hpp"
 
 namespace ba {
@@ -76,6 +79,16 @@ public:
         if (ec && ec.category() == pqcategory())
             return Base::invokeHandler(ec);
 
+        // сокет закрыли мы сами, libpq продолжать бессмысленно: по таймауту - ошибка подключения, как и прежде,
+        // иначе это cancelConnect
+        if (ec && !Base::m_socket.is_open())
+        {
+            if (m_timedOut && *m_timedOut)
+                return Base::invokeHandler(make_error_code(PQError::CONN_POLL_FAILED));
+
+            return Base::invokeHandler(boost::asio::error::operation_aborted);
+        }
+
         const auto pollResult = ::PQconnectPoll(Base::m_conn);
 
         // Если нужно ждать, и ждать еще не начинали, формируем таймер
@@ -84,10 +97,14 @@ public:
             (PGRES_POLLING_READING == pollResult || PGRES_POLLING_WRITING == pollResult))
         {
             m_timer = std::make_shared<boost::asio::deadline_timer>(Base::m_socket.get_io_service(), boost::posix_time::seconds{ m_timeout });
+            m_timedOut = std::make_shared<bool>(false);
             m_timer->async_wait(m_strand.wrap(
-                [&sock{ Base::m_socket }](const boost::system::error_code& ec) {
+                [&sock{ Base::m_socket }, timedOut{ m_timedOut }](const boost::system::error_code& ec) {
                     if (boost::asio::error::operation_aborted != ec) // если это не отмена таймера, то закрываем сокет по таймауту
+                    {
+                        *timedOut = true;
                         sock.close();
+                    }
             }));
         }
 
@@ -117,11 +134,13 @@ private:
     boost::asio::io_service::strand m_strand;
     const boost::posix_time::time_duration::sec_type m_timeout;
     std::shared_ptr<boost::asio::deadline_timer> m_timer; // старый boost требует копирования от handler
+    std::shared_ptr<bool> m_timedOut; // выставляет таймер в m_strand, там же и читается
 };
 
 template <typename ExecHandler, typename ResultCollector>
 class ExecOp
     : private OperationBase<ExecHandler>
+    , private FlightTrace // пустой без BA_ASIOPQ_FLIGHT_RECORDER
 {
     using Base = OperationBase<ExecHandler>;
 
@@ -134,9 +153,12 @@ public:
     ExecOp(const ExecOp&) = default;
     ExecOp& operator=(const ExecOp&) = default;
 
-    ExecOp(PGconn* conn, boost::asio::ip::tcp::socket& s, ExecHandler&& handler, ResultCollector&& coll)
+    ExecOp(PGconn* conn, boost::asio::ip::tcp::socket& s, NotificationHub* hub, ExecHandler&& handler, ResultCollector&& coll, int pipelineSyncs = 0)
         : Base{ conn, s, std::forward<ExecHandler>(handler) }
+        , FlightTrace{ conn }
+        , m_hub{ hub }
         , m_collector{ std::forward<ResultCollector>(coll) }
+        , m_pipelineSyncs{ pipelineSyncs }
     {
     }
 
@@ -146,7 +168,9 @@ public:
         // а ошибку от сокета не обрабатываем,
         // чтобы PQconsumeInput сам обработал сокетные проблемы и перевел m_conn в соответствующиее состояние
         if (ec && ec.category() == pqcategory())
-            return Base::invokeHandler(ec);
+            return complete(ec);
+
+        FlightTrace::traceWakeup();
 
         switch (const int JUMP_OVER_FIRST_CHECK = {})
         {
@@ -156,28 +180,73 @@ public:
                 {
         case JUMP_OVER_FIRST_CHECK:
                     if (!::PQconsumeInput(Base::m_conn)) // пробуем забрть из сокета все, что накопилось без блокирования
-                        return Base::invokeHandler(make_error_code(PQError::CONSUME_INPUT_FAILED));
+                        return complete(make_error_code(PQError::CONSUME_INPUT_FAILED));
+
+                    m_hub->drain(Base::m_conn); // уведомления, пришедшие вперемешку с ответом
 
                     if (::PQisBusy(Base::m_conn)) // опять проверяем, может получили необходимые данные
+                    {
+                        FlightTrace::traceWaiting();
                         return detail::asyncWaitReading(Base::m_socket, std::move(*this)); // не получили, уходим в ожидание сокета на чтение
+                    }
                 }
 
                 ::PGresult* res = ::PQgetResult(Base::m_conn);
-                const auto curEc = m_collector(res);
+#ifdef LIBPQ_HAS_PIPELINING
+                if (res && PGRES_PIPELINE_SYNC == ::PQresultStatus(res))
+                {
+                    ::PQclear(res);
+                    if (0 != --m_pipelineSyncs)
+                        continue;
+
+                    // последняя точка синхронизации, конвейер пуст
+                    if (!::PQexitPipelineMode(Base::m_conn))
+                        return complete(make_error_code(PQError::PIPELINE_FAILED));
+
+                    return complete(m_lastEc);
+                }
+#endif
+                if (res)
+                    FlightTrace::traceResult();
+
+                // в COPY IN и COPY BOTH PQgetResult не вернет nullptr, поток дальше ведет вызывающий
+                // (см. ReplicationStream и BatchWriter)
+                const bool copy = res && (PGRES_COPY_IN == ::PQresultStatus(res) || PGRES_COPY_BOTH == ::PQresultStatus(res));
+
+                // коллектор, забирающий результат, освобождает его сам, остальным он нужен только на время вызова
+                const auto curEc = detail::collectResult(m_collector, Result{ res });
                 if (curEc)
                     m_lastEc = curEc; // если ошибка, то сохраняем ее (перезаписываем предыдущую)
 
+                if (copy)
+                    return complete(m_lastEc, false);
+
                 if (!res) // nullptr означает конец обработки данных (согласно документации PQgetResult)
-                    return Base::invokeHandler(m_lastEc);
+                {
+                    if (0 != m_pipelineSyncs)
+                        continue; // в конвейере nullptr лишь отделяет результаты очередной команды
 
-                ::PQclear(res);
+                    return complete(m_lastEc);
+                }
             }
         }
     }
 
 private:
+    // idle - соединение простаивает; во время COPY его продолжает вести вызывающий, ожидание простоя не заводим
+    void complete(const boost::system::error_code& ec, bool idle = true)
+    {
+        if (idle)
+            m_hub->resume(Base::m_conn, Base::m_socket); // до хендлера, после него Connection может уже не быть
+        FlightTrace::traceComplete(ec);
+        Base::invokeHandler(ec);
+    }
+
+private:
+    NotificationHub* m_hub;
     ResultCollector m_collector;
     boost::system::error_code m_lastEc; // последняя ошибка, которую вернул m_collector
+    int m_pipelineSyncs; // сколько точек синхронизации конвейера еще ждать, 0 - обычный режим
 };
 
 } // namespace detail
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <array>
+#include <tuple>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+
+#include <boost/system/error_code.hpp>
+
+#include <libpq-fe.h>
+
+// Бортовой самописец запросов включается при сборке: -DBA_ASIOPQ_FLIGHT_RECORDER (в CMake - опция
+// BA_ASIOPQ_FLIGHT_RECORDER цели lib.asiopq). Без него все точки записи пустые и ничего не стоят.
+// Макрос меняет устройство ExecOp и пула, поэтому задается для всей программы сразу: единицы трансляции,
+// собранные с ним и без него, нарушают ODR. MSVC ловит смешение при компоновке, остальные компиляторы -
+// только внутри одной единицы трансляции (макрос, определенный после первого заголовка asiopq).
+#ifdef BA_ASIOPQ_FLIGHT_RECORDER
+#define BA_ASIOPQ_FLIGHT_RECORDER_ENABLED 1
+#ifdef _MSC_VER
+#pragma detect_mismatch("BA_ASIOPQ_FLIGHT_RECORDER", "1")
+#endif
+#else
+#define BA_ASIOPQ_FLIGHT_RECORDER_ENABLED 0
+#ifdef _MSC_VER
+#pragma detect_mismatch("BA_ASIOPQ_FLIGHT_RECORDER", "0")
+#endif
+#endif
+
+#ifndef BA_ASIOPQ_FLIGHT_RECORDER_CAPACITY
+#define BA_ASIOPQ_FLIGHT_RECORDER_CAPACITY 1024 // записей в кольце каждого потока
+#endif
+
+namespace ba {
+namespace asiopq {
+
+// Жизненный цикл одного asyncExec. Время - steady_clock в наносекундах, 0 - события не было
+// (например, запрос шел не через пул).
+struct FlightRecord
+{
+    enum Event
+    {
+        ENQUEUED,       // запрос поставлен в ConnectionPool
+        ACQUIRED,       // пул выдал соединение
+        SENT,           // команда отправлена
+        FIRST_READABLE, // первое пробуждение по готовности сокета на чтение
+        FIRST_RESULT,   // первый PQgetResult с результатом
+        LAST_RESULT,    // последний PQgetResult с результатом
+        COMPLETED,      // перед вызовом хендлера
+        EVENT_COUNT
+    };
+
+    std::int64_t at[EVENT_COUNT] = {};
+    // текст не копируется: в приемнике медленных запросов указатель еще действителен,
+    // в снимке - только для статических строк
+    const char* command = nullptr;
+    std::uint64_t paramsDigest = 0; // FNV-1a по значениям параметров
+    int backendPid = 0;
+    unsigned results = 0; // сколько результатов вернул PQgetResult
+    boost::system::error_code error;
+
+    std::int64_t durationNs() const noexcept
+    {
+        return at[COMPLETED] - (at[ENQUEUED] ? at[ENQUEUED] : at[SENT]);
+    }
+};
+
+namespace detail {
+
+inline std::int64_t flightNow() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void fnv1a(std::uint64_t& digest, const void* data, std::size_t size) noexcept
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (std::size_t i = 0; i != size; ++i)
+        digest = (digest ^ bytes[i]) * 1099511628211ull;
+}
+
+template <typename Params>
+std::uint64_t paramsDigest(const Params& params) noexcept
+{
+    std::uint64_t digest = 14695981039346656037ull;
+    const int n = params.n();
+    const char* const* const values = params.values();
+    const int* const lengths = params.lengths();
+    const int* const formats = params.formats();
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (!values[i])
+        {
+            fnv1a(digest, "N", 1);
+            continue;
+        }
+
+        const bool binary = formats && 0 != formats[i];
+        const std::size_t length = binary ? std::size_t(lengths[i]) : std::strlen(values[i]);
+        fnv1a(digest, &length, sizeof(length));
+        fnv1a(digest, values[i], length);
+    }
+
+    return digest;
+}
+
+#ifdef BA_ASIOPQ_FLIGHT_RECORDER
+
+// Кольцо пишет только поток-владелец, без блокировок. Читатели из других потоков
+// копируют запись под счетчиком версий (seqlock) и отбрасывают ту, что менялась во время копирования.
+class FlightRing
+{
+public:
+    void push(const FlightRecord& record) noexcept
+    {
+        const std::size_t next = m_next.load(std::memory_order_relaxed);
+        Slot& slot = m_slots[next % m_slots.size()];
+
+        const unsigned version = slot.version.load(std::memory_order_relaxed);
+        slot.version.store(version + 1, std::memory_order_relaxed); // нечетная - запись идет
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.record = record;
+        slot.version.store(version + 2, std::memory_order_release);
+
+        m_next.store(next + 1, std::memory_order_release);
+    }
+
+    void read(std::vector<FlightRecord>& out) const
+    {
+        for (const Slot& slot : m_slots)
+        {
+            const unsigned before = slot.version.load(std::memory_order_acquire);
+            if (0 == before || 0 != before % 2)
+                continue;
+
+            FlightRecord copy = slot.record;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before == slot.version.load(std::memory_order_relaxed))
+                out.push_back(copy);
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<unsigned> version{ 0 };
+        FlightRecord record;
+    };
+
+    std::array<Slot, BA_ASIOPQ_FLIGHT_RECORDER_CAPACITY> m_slots;
+    std::atomic<std::size_t> m_next{ 0 };
+};
+
+struct FlightRegistry
+{
+    std::mutex mutex;
+    std::vector<std::weak_ptr<FlightRing>> rings;
+    std::atomic<std::int64_t> slowThresholdNs{ -1 }; // -1 - приемник не задан
+    std::shared_ptr<const std::function<void(const FlightRecord&)>> sink; // только через atomic_load/atomic_store
+
+    static FlightRegistry& instance()
+    {
+        static FlightRegistry registry;
+        return registry;
+    }
+
+    static FlightRing& threadRing()
+    {
+        thread_local const std::shared_ptr<FlightRing> ring = instance().add();
+        return *ring;
+    }
+
+private:
+    std::shared_ptr<FlightRing> add()
+    {
+        auto ring = std::make_shared<FlightRing>();
+
+        std::lock_guard<std::mutex> lock{ mutex };
+        rings.erase(std::remove_if(rings.begin(), rings.end(), [](const auto& r) { return r.expired(); }), rings.end());
+        rings.push_back(ring);
+        return ring;
+    }
+};
+
+// сведения, которые asyncExec получает от пула и функций layer2 через поток, в котором вызывается
+struct FlightContext
+{
+    const char* command = nullptr;
+    std::uint64_t paramsDigest = 0;
+    std::int64_t enqueued = 0;
+    std::int64_t acquired = 0;
+};
+
+inline FlightContext& flightContext() noexcept
+{
+    thread_local FlightContext context;
+    return context;
+}
+
+class FlightStamp
+{
+public:
+    FlightStamp() noexcept
+        : m_at{ flightNow() }
+    {
+    }
+
+    std::int64_t at() const noexcept
+    {
+        return m_at;
+    }
+
+private:
+    std::int64_t m_at;
+};
+
+// на время вызова операции пулом
+class FlightPoolScope
+{
+public:
+    FlightPoolScope(const FlightStamp& enqueued, const FlightStamp& acquired) noexcept
+        : m_saved{ flightContext() }
+    {
+        flightContext().enqueued = enqueued.at();
+        flightContext().acquired = acquired.at();
+    }
+
+    ~FlightPoolScope()
+    {
+        flightContext() = m_saved;
+    }
+
+private:
+    const FlightContext m_saved;
+};
+
+// на время вызова asyncExec функцией layer2
+class FlightAnnotation
+{
+public:
+    explicit FlightAnnotation(const char* command) noexcept
+        : m_saved{ flightContext() }
+    {
+        flightContext().command = command;
+        flightContext().paramsDigest = 0;
+    }
+
+    template <typename Params>
+    FlightAnnotation(const char* command, const Params& params) noexcept
+        : FlightAnnotation{ command }
+    {
+        flightContext().paramsDigest = paramsDigest(params);
+    }
+
+    ~FlightAnnotation()
+    {
+        flightContext() = m_saved;
+    }
+
+private:
+    const FlightContext m_saved;
+};
+
+// запись, которую ExecOp несет с собой до завершения
+class FlightTrace
+{
+public:
+    explicit FlightTrace(PGconn* conn) noexcept
+    {
+        const FlightContext& context = flightContext();
+        m_record.at[FlightRecord::ENQUEUED] = context.enqueued;
+        m_record.at[FlightRecord::ACQUIRED] = context.acquired;
+        m_record.at[FlightRecord::SENT] = flightNow();
+        m_record.command = context.command;
+        m_record.paramsDigest = context.paramsDigest;
+        m_record.backendPid = ::PQbackendPID(conn);
+    }
+
+    void traceWaiting() noexcept
+    {
+        m_waiting = true;
+    }
+
+    void traceWakeup() noexcept
+    {
+        if (m_waiting && !m_record.at[FlightRecord::FIRST_READABLE])
+            m_record.at[FlightRecord::FIRST_READABLE] = flightNow();
+    }
+
+    void traceResult() noexcept
+    {
+        const std::int64_t now = flightNow();
+        if (0 == m_record.results++)
+            m_record.at[FlightRecord::FIRST_RESULT] = now;
+        m_record.at[FlightRecord::LAST_RESULT] = now;
+    }
+
+    void traceComplete(const boost::system::error_code& ec) noexcept
+    {
+        m_record.at[FlightRecord::COMPLETED] = flightNow();
+        m_record.error = ec;
+
+        FlightRegistry::threadRing().push(m_record);
+
+        auto& registry = FlightRegistry::instance();
+        const std::int64_t threshold = registry.slowThresholdNs.load(std::memory_order_relaxed);
+        if (threshold < 0 || m_record.durationNs() < threshold)
+            return;
+
+        const auto sink = std::atomic_load(&registry.sink);
+        if (sink)
+            (*sink)(m_record);
+    }
+
+private:
+    FlightRecord m_record;
+    bool m_waiting = false;
+};
+
+#else // BA_ASIOPQ_FLIGHT_RECORDER
+
+struct FlightStamp
+{
+};
+
+struct FlightPoolScope
+{
+    FlightPoolScope(const FlightStamp&, const FlightStamp&) noexcept
+    {
+    }
+};
+
+struct FlightAnnotation
+{
+    explicit FlightAnnotation(const char*) noexcept
+    {
+    }
+
+    template <typename Params>
+    FlightAnnotation(const char*, const Params&) noexcept
+    {
+    }
+};
+
+struct FlightTrace
+{
+    explicit FlightTrace(PGconn*) noexcept
+    {
+    }
+
+    void traceWaiting() noexcept
+    {
+    }
+
+    void traceWakeup() noexcept
+    {
+    }
+
+    void traceResult() noexcept
+    {
+    }
+
+    void traceComplete(const boost::system::error_code&) noexcept
+    {
+    }
+};
+
+#endif // BA_ASIOPQ_FLIGHT_RECORDER
+
+} // namespace detail
+
+// Настройка и чтение самописца. Без BA_ASIOPQ_FLIGHT_RECORDER снимок всегда пуст.
+class FlightRecorder
+{
+public:
+    using Sink = std::function<void(const FlightRecord&)>;
+
+    // sink вызывается в потоке, завершившем запрос, для запросов дольше threshold
+    // (от постановки в пул, либо от отправки), и не должен блокировать
+    static void setSlowQuerySink(std::chrono::nanoseconds threshold, Sink sink)
+    {
+#ifdef BA_ASIOPQ_FLIGHT_RECORDER
+        auto& registry = detail::FlightRegistry::instance();
+        const bool enabled = bool(sink);
+        std::atomic_store(&registry.sink, enabled ? std::make_shared<const Sink>(std::move(sink)) : nullptr);
+        registry.slowThresholdNs.store(enabled ? threshold.count() : -1, std::memory_order_relaxed);
+#else
+        std::ignore = threshold;
+        std::ignore = sink;
+#endif
+    }
+
+    // последние записи всех потоков, без упорядочивания
+    static std::vector<FlightRecord> snapshot()
+    {
+        std::vector<FlightRecord> records;
+#ifdef BA_ASIOPQ_FLIGHT_RECORDER
+        auto& registry = detail::FlightRegistry::instance();
+        std::lock_guard<std::mutex> lock{ registry.mutex };
+        for (const auto& weak : registry.rings)
+            if (const auto ring = weak.lock())
+                ring->read(records);
+#endif
+        return records;
+    }
+};
+
+} // namespace asiopq
+} // namespace ba
@@ -20,7 +20,7 @@ struct IgnoreResult
         case PGRES_BAD_RESPONSE:
             return make_error_code(PQError::RESULT_BAD_RESPONSE);
         case PGRES_FATAL_ERROR:
-            return make_error_code(PQError::RESULT_FATAL_ERROR);
+            return resultErrorCode(res);
         default:
             return {}; // нет ошибки
         }
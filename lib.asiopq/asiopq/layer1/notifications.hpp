@@ -0,0 +1,190 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include <libpq-fe.h>
+
+#include "detail/async_wait_socket.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct Notification
+{
+    std::string channel;
+    std::string payload;
+    int backendPid;
+};
+
+using NotificationHandler = std::function<void(const Notification&)>;
+
+namespace detail {
+
+// Раздает уведомления из очереди PQnotifies подписчикам по имени канала
+// и держит ожидание чтения на простаивающем сокете, если соединение слушает.
+// Живет в shared_ptr, чтобы отмененный хендлер ожидания мог безопасно обратиться к нему после удаления Connection.
+// Ожидание простоя и начало команды сериализуются m_connMutex, io_service может крутиться в нескольких потоках.
+class NotificationHub
+    : public std::enable_shared_from_this<NotificationHub>
+{
+public:
+    std::size_t subscribe(std::string channel, NotificationHandler handler)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        const std::size_t id = ++m_lastId;
+        m_subscribers.emplace(
+              std::move(channel)
+            , std::make_pair(id, std::make_shared<NotificationHandler>(std::move(handler)))
+            );
+        return id;
+    }
+
+    void unsubscribe(std::size_t id)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        for (auto it = m_subscribers.begin(); it != m_subscribers.end(); ++it)
+        {
+            if (it->second.first == id)
+            {
+                m_subscribers.erase(it);
+                return;
+            }
+        }
+    }
+
+    // вызывается после каждого успешного PQconsumeInput, иначе уведомления копятся в libpq
+    void drain(PGconn* conn)
+    {
+        while (::PGnotify* notify = ::PQnotifies(conn))
+        {
+            Notification n{ notify->relname, notify->extra ? notify->extra : "", notify->be_pid };
+            ::PQfreemem(notify);
+            dispatch(n);
+        }
+    }
+
+    void startListening(PGconn* conn, boost::asio::ip::tcp::socket& s)
+    {
+        std::lock_guard<std::mutex> lock{ m_connMutex };
+        m_listening = true;
+        armIdleWait(conn, s);
+    }
+
+    void stopListening(boost::asio::ip::tcp::socket& s)
+    {
+        std::lock_guard<std::mutex> lock{ m_connMutex };
+        if (!m_listening.exchange(false))
+            return;
+
+        disarmIdleWait(s);
+    }
+
+    bool listening() const noexcept
+    {
+        return m_listening;
+    }
+
+    // На время выполнения команды сокет читает ExecOp, ожидание простоя снимаем.
+    // Вызывается до отправки команды: после suspend хендлер ожидания к PGconn уже не прикоснется
+    void suspend(boost::asio::ip::tcp::socket& s)
+    {
+        std::lock_guard<std::mutex> lock{ m_connMutex };
+        m_execInProgress = true;
+        if (m_listening)
+            disarmIdleWait(s);
+    }
+
+    void resume(PGconn* conn, boost::asio::ip::tcp::socket& s)
+    {
+        std::lock_guard<std::mutex> lock{ m_connMutex };
+        m_execInProgress = false;
+        armIdleWait(conn, s);
+    }
+
+private:
+    void dispatch(const Notification& n)
+    {
+        std::vector<std::shared_ptr<NotificationHandler>> handlers;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            const auto range = m_subscribers.equal_range(n.channel);
+            for (auto it = range.first; it != range.second; ++it)
+                handlers.push_back(it->second.second);
+        }
+
+        // вызываем без блокировки, чтобы подписчик мог отписаться прямо из хендлера
+        for (const auto& handler : handlers)
+            (*handler)(n);
+    }
+
+    // под m_connMutex
+    void armIdleWait(PGconn* conn, boost::asio::ip::tcp::socket& s)
+    {
+        if (!m_listening || m_execInProgress || !s.is_open())
+            return;
+
+        const unsigned generation = ++m_generation;
+        asyncWaitReading(s, [self{ shared_from_this() }, conn, &s, generation](const boost::system::error_code& ec) {
+            std::vector<Notification> notifications;
+            {
+                // хендлер может исполняться в другом потоке одновременно с началом команды на соединении
+                std::lock_guard<std::mutex> lock{ self->m_connMutex };
+
+                // отмена означает, что сокет закрыт или его забрал ExecOp, к conn и s больше не прикасаемся
+                if (boost::asio::error::operation_aborted == ec || generation != self->m_generation || self->m_execInProgress)
+                    return;
+
+                if (ec || !::PQconsumeInput(conn))
+                {
+                    self->m_listening = false; // соединение сломано, слушать дальше нечего
+                    return;
+                }
+
+                while (::PGnotify* notify = ::PQnotifies(conn))
+                {
+                    notifications.push_back(Notification{ notify->relname, notify->extra ? notify->extra : "", notify->be_pid });
+                    ::PQfreemem(notify);
+                }
+            }
+
+            // подписчики вызываются без блокировки: из хендлера можно выполнять команды на этом же соединении
+            for (const auto& n : notifications)
+                self->dispatch(n);
+
+            std::lock_guard<std::mutex> lock{ self->m_connMutex };
+            if (generation == self->m_generation) // пока раздавали, ожидание могли снять или завести заново
+                self->armIdleWait(conn, s);
+        });
+    }
+
+    // под m_connMutex
+    void disarmIdleWait(boost::asio::ip::tcp::socket& s)
+    {
+        ++m_generation;
+        boost::system::error_code ignoreEc;
+        s.cancel(ignoreEc);
+    }
+
+private:
+    std::mutex m_mutex;
+    std::size_t m_lastId = 0;
+    std::multimap<std::string, std::pair<std::size_t, std::shared_ptr<NotificationHandler>>> m_subscribers;
+    // PGconn и сокет трогают и хендлер ожидания простоя, и начало команды на соединении
+    std::mutex m_connMutex;
+    std::atomic_bool m_listening{ false };
+    std::atomic_bool m_execInProgress{ false };
+    std::atomic_uint m_generation{ 0 };
+};
+
+} // namespace detail
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+#include <boost/utility/string_view.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <libpq-fe.h>
+
+#include "../error.hpp"
+#include "ignore_result.hpp"
+
+namespace ba {
+namespace asiopq {
+
+// Владеющий PGresult хендл, только перемещаемый.
+// PGresult после получения не изменяется, поэтому читать его можно из любого потока,
+// в том числе отдав хендл рабочему потоку. value возвращает представление без копирования,
+// оно действительно, пока жив хендл (или разделяемый указатель из share).
+class Result
+{
+public:
+    Result() = default;
+
+    explicit Result(::PGresult* res) noexcept
+        : m_res{ res }
+    {
+    }
+
+    const ::PGresult* get() const noexcept
+    {
+        return m_res.get();
+    }
+
+    ::PGresult* release() noexcept
+    {
+        return m_res.release();
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return bool(m_res);
+    }
+
+    ExecStatusType status() const noexcept
+    {
+        return ::PQresultStatus(m_res.get());
+    }
+
+    int rows() const noexcept
+    {
+        return ::PQntuples(m_res.get());
+    }
+
+    int columns() const noexcept
+    {
+        return ::PQnfields(m_res.get());
+    }
+
+    bool isNull(int row, int column) const noexcept
+    {
+        return 0 != ::PQgetisnull(m_res.get(), row, column);
+    }
+
+    boost::string_view value(int row, int column) const noexcept
+    {
+        return { ::PQgetvalue(m_res.get(), row, column), std::size_t(::PQgetlength(m_res.get(), row, column)) };
+    }
+
+    // переводит во владение по счетчику ссылок, если результат нужен нескольким читателям
+    std::shared_ptr<const ::PGresult> share() && noexcept
+    {
+        return { m_res.release(), ::PQclear };
+    }
+
+private:
+    struct Clear
+    {
+        void operator()(::PGresult* res) const noexcept
+        {
+            ::PQclear(res);
+        }
+    };
+
+    std::unique_ptr<::PGresult, Clear> m_res;
+};
+
+namespace detail {
+
+template <typename...>
+using VoidT = void;
+
+} // namespace detail
+
+// Коллектор, объявивший using TakesOwnership = std::true_type, получает результаты как Result
+// (конец данных - пустой Result) и сам решает, сколько их держать, ExecOp не вызывает для них PQclear.
+// Остальные коллекторы получают const PGresult*, действительный только до возврата из коллектора.
+template <typename ResultCollector, typename = void>
+struct TakesResultOwnership
+    : std::false_type
+{
+};
+
+template <typename ResultCollector>
+struct TakesResultOwnership<ResultCollector, detail::VoidT<typename ResultCollector::TakesOwnership>>
+    : ResultCollector::TakesOwnership
+{
+};
+
+namespace detail {
+
+template <typename ResultCollector>
+boost::system::error_code collectResult(ResultCollector& coll, Result&& res, std::true_type)
+{
+    return coll(std::move(res));
+}
+
+template <typename ResultCollector>
+boost::system::error_code collectResult(ResultCollector& coll, Result&& res, std::false_type)
+{
+    return coll(res.get()); // результат освободится на выходе
+}
+
+// передача результата коллектору согласно его контракту
+template <typename ResultCollector>
+boost::system::error_code collectResult(ResultCollector& coll, Result&& res)
+{
+    return collectResult(coll, std::move(res), TakesResultOwnership<std::decay_t<ResultCollector>>{});
+}
+
+} // namespace detail
+
+// Забирает последний результат с данными без копирования, ошибки - как в IgnoreResult.
+// out должен жить до завершения операции.
+class KeepResult
+{
+public:
+    using TakesOwnership = std::true_type;
+
+    explicit KeepResult(Result& out)
+        : m_out{ &out }
+    {
+    }
+
+    boost::system::error_code operator()(Result res) const
+    {
+        const auto ec = IgnoreResult{}(res.get());
+        if (!ec && res && PGRES_TUPLES_OK == res.status())
+            *m_out = std::move(res);
+
+        return ec;
+    }
+
+private:
+    Result* m_out;
+};
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+
+#include "../layer1/connection.hpp"
+
+namespace ba {
+namespace asiopq {
+
+namespace detail {
+
+// собирает команду вида "LISTEN имя" с экранированием идентификатора средствами libpq
+inline std::string makeChannelCommand(PGconn* conn, const char* command, const std::string& channel)
+{
+    char* const escaped = ::PQescapeIdentifier(conn, channel.c_str(), channel.size());
+    if (!escaped)
+        return {};
+
+    std::string result{ command };
+    result += ' ';
+    result += escaped;
+    ::PQfreemem(escaped);
+    return result;
+}
+
+} // namespace detail
+
+// подписывает соединение на канал на стороне сервера,
+// уведомления раздаются хендлерам Connection::subscribe
+template <typename Handler, typename ResultCollector = IgnoreResult>
+auto asyncListen(Connection& conn, const std::string& channel, Handler&& handler, ResultCollector&& coll = {})
+{
+    return conn.asyncExec(
+        [pgConn{ conn.get() }, &channel]{
+            const std::string command = detail::makeChannelCommand(pgConn, "LISTEN", channel);
+            if (command.empty() || !::PQsendQuery(pgConn, command.c_str()))
+                return make_error_code(PQError::SEND_QUERY_FAILED);
+
+            return boost::system::error_code{};
+        },
+        std::forward<Handler>(handler),
+        std::forward<ResultCollector>(coll)
+    );
+}
+
+template <typename Handler, typename ResultCollector = IgnoreResult>
+auto asyncUnlisten(Connection& conn, const std::string& channel, Handler&& handler, ResultCollector&& coll = {})
+{
+    return conn.asyncExec(
+        [pgConn{ conn.get() }, &channel]{
+            const std::string command = detail::makeChannelCommand(pgConn, "UNLISTEN", channel);
+            if (command.empty() || !::PQsendQuery(pgConn, command.c_str()))
+                return make_error_code(PQError::SEND_QUERY_FAILED);
+
+            return boost::system::error_code{};
+        },
+        std::forward<Handler>(handler),
+        std::forward<ResultCollector>(coll)
+    );
+}
+
+} // namespace ba
+} // namespace asiopq
@@ -8,6 +8,7 @@ namespace asiopq {
 template <typename Handler, typename ResultCollector = IgnoreResult>
 auto asyncQuery(Connection& conn, const char* query, Handler&& handler, ResultCollector&& coll = {})
 {
+    const detail::FlightAnnotation annotation{ query };
     return conn.asyncExec(
         [pgConn{ conn.get() }, query]{
             if (!::PQsendQuery(pgConn, query))
@@ -8,6 +8,7 @@ namespace asiopq {
 template <typename Params, typename Handler, typename ResultCollector = IgnoreResult>
 auto asyncQueryParams(Connection& conn, const char* command, const Params& params, bool textResultFormat, Handler&& handler, ResultCollector&& coll = {})
 {
+    const detail::FlightAnnotation annotation{ command, params };
     return conn.asyncExec(
         [pgConn{ conn.get() }, command, &params, textResultFormat]{
             if (!::PQsendQueryParams(pgConn, command, params.n(), params.types(), params.values(), params.lengths(), params.formats(), textResultFormat ? 0 : 1))
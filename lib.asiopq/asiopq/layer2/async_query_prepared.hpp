@@ -8,6 +8,7 @@ namespace asiopq {
 template <typename Params, typename Handler, typename ResultCollector = IgnoreResult>
 auto asyncQueryPrepared(Connection& conn, const char* name, const Params& params, bool textResultFormat, Handler&& handler, ResultCollector&& coll = {})
 {
+    const detail::FlightAnnotation annotation{ name, params }; // для подготовленного запроса - имя
     return conn.asyncExec(
         [pgConn{ conn.get() }, name, &params, textResultFormat]{
             if (!::PQsendQueryPrepared(pgConn, name, params.n(), params.values(), params.lengths(), params.formats(), textResultFormat ? 0 : 1))
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <new>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+#include "../layer1/connection.hpp"
+
+namespace ba {
+namespace asiopq {
+
+namespace detail {
+
+// Хранилище объекта произвольного типа: на месте, если объект помещается в BufferSize
+// и перемещается без исключений, иначе в куче. Тип объекта знает только владелец (через таблицу функций).
+template <std::size_t BufferSize>
+class ErasedStorage
+{
+    static_assert(BufferSize >= sizeof(void*), "ErasedStorage buffer must fit a pointer");
+
+public:
+    template <typename T>
+    static constexpr bool isInline() noexcept
+    {
+        return sizeof(T) <= BufferSize
+            && alignof(T) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<T>::value;
+    }
+
+    template <typename T, typename... Args>
+    std::enable_if_t<isInline<T>()> construct(Args&&... args)
+    {
+        ::new (static_cast<void*>(&m_data)) T(std::forward<Args>(args)...);
+    }
+
+    template <typename T, typename... Args>
+    std::enable_if_t<!isInline<T>()> construct(Args&&... args)
+    {
+        heap() = new T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    std::enable_if_t<isInline<T>(), T&> get() noexcept
+    {
+        return *reinterpret_cast<T*>(&m_data);
+    }
+
+    template <typename T>
+    std::enable_if_t<!isInline<T>(), T&> get() noexcept
+    {
+        return *static_cast<T*>(heap());
+    }
+
+    template <typename T>
+    std::enable_if_t<isInline<T>(), const T&> get() const noexcept
+    {
+        return *reinterpret_cast<const T*>(&m_data);
+    }
+
+    template <typename T>
+    std::enable_if_t<!isInline<T>(), const T&> get() const noexcept
+    {
+        return *static_cast<const T*>(heap());
+    }
+
+    template <typename T>
+    std::enable_if_t<isInline<T>()> destroy() noexcept
+    {
+        get<T>().~T();
+    }
+
+    template <typename T>
+    std::enable_if_t<!isInline<T>()> destroy() noexcept
+    {
+        delete &get<T>();
+    }
+
+    // from после перемещения пуст, destroy для него не вызывается
+    template <typename T>
+    std::enable_if_t<isInline<T>()> moveFrom(ErasedStorage& from) noexcept
+    {
+        construct<T>(std::move(from.get<T>()));
+        from.destroy<T>();
+    }
+
+    template <typename T>
+    std::enable_if_t<!isInline<T>()> moveFrom(ErasedStorage& from) noexcept
+    {
+        heap() = from.heap();
+    }
+
+    template <typename T>
+    void copyFrom(const ErasedStorage& from)
+    {
+        construct<T>(from.get<T>());
+    }
+
+private:
+    void*& heap() noexcept
+    {
+        return *reinterpret_cast<void**>(&m_data);
+    }
+
+    void* heap() const noexcept
+    {
+        return *reinterpret_cast<void* const*>(&m_data);
+    }
+
+private:
+    std::aligned_storage_t<BufferSize, alignof(std::max_align_t)> m_data;
+};
+
+} // namespace detail
+
+// Хендлер void(const boost::system::error_code&) со стиранием типа, в отличие от std::function
+// хранит хендлер размером до BufferSize без выделения памяти. Копируемый, как того требует asio от хендлеров.
+// Хуки asio исходного хендлера не пробрасываются: его operator() вызывается напрямую
+// (хендлер, обернутый strand.wrap, сам выполнится в своем strand).
+template <std::size_t BufferSize>
+class BasicAnyHandler
+{
+public:
+    BasicAnyHandler() = default;
+
+    BasicAnyHandler(const BasicAnyHandler& other)
+        : m_vtable{ other.m_vtable }
+    {
+        if (m_vtable)
+            m_vtable->copy(m_storage, other.m_storage);
+    }
+
+    BasicAnyHandler& operator=(const BasicAnyHandler& other)
+    {
+        if (this != &other)
+            *this = BasicAnyHandler{ other };
+        return *this;
+    }
+
+    BasicAnyHandler(BasicAnyHandler&& other) noexcept
+    {
+        moveFrom(other);
+    }
+
+    BasicAnyHandler& operator=(BasicAnyHandler&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    template <
+          typename Handler
+        , std::enable_if_t<!std::is_same<std::decay_t<Handler>, BasicAnyHandler>::value, bool> = true
+        >
+    BasicAnyHandler(Handler&& handler)
+        : m_vtable{ vtableFor<std::decay_t<Handler>>() }
+    {
+        m_storage.template construct<std::decay_t<Handler>>(std::forward<Handler>(handler));
+    }
+
+    ~BasicAnyHandler()
+    {
+        reset();
+    }
+
+    void operator()(const boost::system::error_code& ec)
+    {
+        assert(m_vtable);
+        m_vtable->invoke(m_storage, ec);
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return nullptr != m_vtable;
+    }
+
+private:
+    using Storage = detail::ErasedStorage<BufferSize>;
+
+    struct VTable
+    {
+        void (*invoke)(Storage&, const boost::system::error_code&);
+        void (*copy)(Storage& to, const Storage& from);
+        void (*move)(Storage& to, Storage& from) noexcept;
+        void (*destroy)(Storage&) noexcept;
+    };
+
+    template <typename Handler>
+    static const VTable* vtableFor() noexcept
+    {
+        static const VTable vtable{
+              [](Storage& storage, const boost::system::error_code& ec) { storage.template get<Handler>()(ec); }
+            , [](Storage& to, const Storage& from) { to.template copyFrom<Handler>(from); }
+            , [](Storage& to, Storage& from) noexcept { to.template moveFrom<Handler>(from); }
+            , [](Storage& storage) noexcept { storage.template destroy<Handler>(); }
+        };
+        return &vtable;
+    }
+
+    void moveFrom(BasicAnyHandler& other) noexcept
+    {
+        m_vtable = other.m_vtable;
+        if (m_vtable)
+            m_vtable->move(m_storage, other.m_storage);
+        other.m_vtable = nullptr;
+    }
+
+    void reset() noexcept
+    {
+        if (m_vtable)
+            m_vtable->destroy(m_storage);
+        m_vtable = nullptr;
+    }
+
+private:
+    const VTable* m_vtable = nullptr;
+    Storage m_storage;
+};
+
+// Перемещаемая операция void(Connection&, Handler) со стиранием типа, замена PolymorphicOperationType для пулов
+// с разнородными запросами: операции и хендлеры размером до BufferSize не выделяют память, захваты операции
+// не обязаны копироваться. Хендлер пула операция получает как BasicAnyHandler<BufferSize>.
+template <std::size_t BufferSize>
+class BasicAnyOperation
+{
+public:
+    using Handler = BasicAnyHandler<BufferSize>;
+
+    BasicAnyOperation() = default;
+    BasicAnyOperation(const BasicAnyOperation&) = delete;
+    BasicAnyOperation& operator=(const BasicAnyOperation&) = delete;
+
+    BasicAnyOperation(BasicAnyOperation&& other) noexcept
+    {
+        moveFrom(other);
+    }
+
+    BasicAnyOperation& operator=(BasicAnyOperation&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    template <
+          typename Op
+        , std::enable_if_t<!std::is_same<std::decay_t<Op>, BasicAnyOperation>::value, bool> = true
+        >
+    BasicAnyOperation(Op&& op)
+        : m_vtable{ vtableFor<std::decay_t<Op>>() }
+    {
+        m_storage.template construct<std::decay_t<Op>>(std::forward<Op>(op));
+    }
+
+    ~BasicAnyOperation()
+    {
+        reset();
+    }
+
+    template <typename OtherHandler>
+    void operator()(Connection& conn, OtherHandler&& handler)
+    {
+        assert(m_vtable);
+        m_vtable->invoke(m_storage, conn, Handler{ std::forward<OtherHandler>(handler) });
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return nullptr != m_vtable;
+    }
+
+private:
+    using Storage = detail::ErasedStorage<BufferSize>;
+
+    struct VTable
+    {
+        void (*invoke)(Storage&, Connection&, Handler&&);
+        void (*move)(Storage& to, Storage& from) noexcept;
+        void (*destroy)(Storage&) noexcept;
+    };
+
+    template <typename Op>
+    static const VTable* vtableFor() noexcept
+    {
+        static const VTable vtable{
+              [](Storage& storage, Connection& conn, Handler&& handler) { storage.template get<Op>()(conn, std::move(handler)); }
+            , [](Storage& to, Storage& from) noexcept { to.template moveFrom<Op>(from); }
+            , [](Storage& storage) noexcept { storage.template destroy<Op>(); }
+        };
+        return &vtable;
+    }
+
+    void moveFrom(BasicAnyOperation& other) noexcept
+    {
+        m_vtable = other.m_vtable;
+        if (m_vtable)
+            m_vtable->move(m_storage, other.m_storage);
+        other.m_vtable = nullptr;
+    }
+
+    void reset() noexcept
+    {
+        if (m_vtable)
+            m_vtable->destroy(m_storage);
+        m_vtable = nullptr;
+    }
+
+private:
+    const VTable* m_vtable = nullptr;
+    Storage m_storage;
+};
+
+// хендлер ConnectionPool (strand.wrap с хендлером пользователя в std::function и состоянием запроса)
+// занимает около 100 байт на 64-битной платформе
+using AnyOperation = BasicAnyOperation<16 * sizeof(void*)>;
+using AnyHandler = AnyOperation::Handler;
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <boost/endian/conversion.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <libpq-fe.h>
+
+#include "../error.hpp"
+
+namespace ba {
+namespace asiopq {
+
+namespace detail {
+
+// OID встроенных типов из pg_type.h, клиенту этот заголовок не доступен
+constexpr Oid BOOL_OID = 16;
+constexpr Oid INT8_OID = 20;
+constexpr Oid INT2_OID = 21;
+constexpr Oid INT4_OID = 23;
+constexpr Oid OID_OID = 26;
+constexpr Oid FLOAT4_OID = 700;
+constexpr Oid FLOAT8_OID = 701;
+
+// размер значения в байтах для типов, которые раскладываются в плотный массив, 0 - тип переменной длины
+inline std::size_t fixedWidthOf(Oid type) noexcept
+{
+    switch (type)
+    {
+    case BOOL_OID:
+        return 1;
+    case INT2_OID:
+        return 2;
+    case INT4_OID:
+    case OID_OID:
+    case FLOAT4_OID:
+        return 4;
+    case INT8_OID:
+    case FLOAT8_OID:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+} // namespace detail
+
+// колонка в Arrow-подобной раскладке:
+// битовая маска валидности (бит 1 - значение есть, младший бит - первая строка),
+// для числовых типов плотный массив значений в нативном порядке байт (bool - по байту на значение),
+// для остальных - массив смещений размером size() + 1 и склеенные байты значений
+class Column
+{
+public:
+    const std::string& name() const noexcept
+    {
+        return m_name;
+    }
+
+    Oid type() const noexcept
+    {
+        return m_type;
+    }
+
+    // 0 - текстовый формат, 1 - двоичный (как PQfformat)
+    int format() const noexcept
+    {
+        return m_format;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+    std::size_t nullCount() const noexcept
+    {
+        return m_nullCount;
+    }
+
+    // 0 для колонок переменной длины
+    std::size_t width() const noexcept
+    {
+        return m_width;
+    }
+
+    bool isFixedWidth() const noexcept
+    {
+        return 0 != m_width;
+    }
+
+    bool isNull(std::size_t row) const noexcept
+    {
+        return 0 == (m_validity[row / 8] & (1u << (row % 8)));
+    }
+
+    const std::uint8_t* validity() const noexcept
+    {
+        return m_validity.data();
+    }
+
+    // только для isFixedWidth(), T должен совпадать по размеру с width()
+    template <typename T>
+    const T* values() const noexcept
+    {
+        assert(sizeof(T) == m_width);
+        return reinterpret_cast<const T*>(m_data.data());
+    }
+
+    // только для !isFixedWidth()
+    const std::int32_t* offsets() const noexcept
+    {
+        return m_offsets.data();
+    }
+
+    const char* data() const noexcept
+    {
+        return m_data.data();
+    }
+
+    boost::string_view value(std::size_t row) const noexcept
+    {
+        assert(!isFixedWidth());
+        return { m_data.data() + m_offsets[row], std::size_t(m_offsets[row + 1] - m_offsets[row]) };
+    }
+
+private:
+    friend class ColumnarResult;
+
+    // подготовка к новой порции, память не освобождается, чтобы переиспользоваться в следующих выполнениях
+    void reset(const ::PGresult* res, int field)
+    {
+        m_name = ::PQfname(res, field);
+        m_type = ::PQftype(res, field);
+        m_format = ::PQfformat(res, field);
+        m_width = detail::fixedWidthOf(m_type);
+        m_size = 0;
+        m_nullCount = 0;
+        m_validity.clear();
+        m_data.clear();
+        m_offsets.clear();
+
+        if (!isFixedWidth())
+            m_offsets.push_back(0);
+    }
+
+    void reserve(std::size_t rows)
+    {
+        m_validity.reserve((rows + 7) / 8);
+
+        if (isFixedWidth())
+        {
+            m_data.reserve(rows * m_width);
+        }
+        else
+        {
+            m_offsets.reserve(rows + 1);
+        }
+    }
+
+    void append(const ::PGresult* res, int row, int field)
+    {
+        if (0 == m_size % 8)
+            m_validity.push_back(0);
+
+        const bool null = ::PQgetisnull(res, row, field);
+        if (null)
+            ++m_nullCount;
+        else
+            m_validity.back() |= std::uint8_t(1u << (m_size % 8));
+
+        ++m_size;
+
+        if (!isFixedWidth())
+        {
+            if (!null)
+                m_data.insert(m_data.end(), ::PQgetvalue(res, row, field), ::PQgetvalue(res, row, field) + ::PQgetlength(res, row, field));
+
+            m_offsets.push_back(std::int32_t(m_data.size()));
+            return;
+        }
+
+        const std::size_t pos = m_data.size();
+        m_data.resize(pos + m_width); // для NULL остаются нули
+        if (null)
+            return;
+
+        if (0 == m_format)
+            parseText(::PQgetvalue(res, row, field), m_data.data() + pos);
+        else
+            parseBinary(::PQgetvalue(res, row, field), m_data.data() + pos);
+    }
+
+    void parseText(const char* text, char* out) const noexcept
+    {
+        switch (m_type)
+        {
+        case detail::BOOL_OID:
+            *out = ('t' == *text);
+            break;
+        case detail::INT2_OID:
+            store(std::int16_t(std::strtol(text, nullptr, 10)), out);
+            break;
+        case detail::INT4_OID:
+            store(std::int32_t(std::strtol(text, nullptr, 10)), out);
+            break;
+        case detail::OID_OID:
+            store(std::uint32_t(std::strtoul(text, nullptr, 10)), out);
+            break;
+        case detail::INT8_OID:
+            store(std::int64_t(std::strtoll(text, nullptr, 10)), out);
+            break;
+        case detail::FLOAT4_OID:
+            store(std::strtof(text, nullptr), out);
+            break;
+        case detail::FLOAT8_OID:
+            store(std::strtod(text, nullptr), out);
+            break;
+        default:
+            assert(!"Unexpected fixed width type");
+        }
+    }
+
+    // в двоичном формате PostgreSQL передает числа в сетевом порядке байт
+    void parseBinary(const char* bin, char* out) const noexcept
+    {
+        switch (m_width)
+        {
+        case 1:
+            *out = *bin;
+            break;
+        case 2:
+            store(boost::endian::big_to_native(load<std::uint16_t>(bin)), out);
+            break;
+        case 4:
+            store(boost::endian::big_to_native(load<std::uint32_t>(bin)), out);
+            break;
+        case 8:
+            store(boost::endian::big_to_native(load<std::uint64_t>(bin)), out);
+            break;
+        default:
+            assert(!"Unexpected fixed width");
+        }
+    }
+
+    template <typename T>
+    static T load(const char* in) noexcept
+    {
+        T value;
+        std::memcpy(&value, in, sizeof(value));
+        return value;
+    }
+
+    template <typename T>
+    static void store(T value, char* out) noexcept
+    {
+        std::memcpy(out, &value, sizeof(value));
+    }
+
+private:
+    std::string m_name;
+    Oid m_type = 0;
+    int m_format = 0;
+    std::size_t m_width = 0;
+    std::size_t m_size = 0;
+    std::size_t m_nullCount = 0;
+    std::vector<std::uint8_t> m_validity;
+    std::vector<char> m_data;
+    std::vector<std::int32_t> m_offsets;
+};
+
+// ResultCollector, который раскладывает PGresult по колонкам.
+// Собирает все строки одного выполнения, в том числе поток PGRES_SINGLE_TUPLE в однострочном режиме,
+// схема берется из первого результата с данными, все последующие результаты выполнения должны ей соответствовать.
+// Буферы переиспользуются между выполнениями, поэтому коллектор нужно передавать в asyncExec по lvalue-ссылке
+// и не трогать его до вызова хендлера.
+class ColumnarResult
+{
+public:
+    boost::system::error_code operator()(const ::PGresult* res)
+    {
+        if (!res) // конец данных, следующий результат начнет новую порцию
+        {
+            m_complete = true;
+            return {};
+        }
+
+        if (m_complete)
+            reset();
+
+        switch (::PQresultStatus(res))
+        {
+        case PGRES_BAD_RESPONSE:
+            return make_error_code(PQError::RESULT_BAD_RESPONSE);
+        case PGRES_FATAL_ERROR:
+            return resultErrorCode(res);
+        case PGRES_TUPLES_OK:
+        case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK:
+#endif
+            return append(res);
+        default:
+            return {}; // команды без данных пропускаем
+        }
+    }
+
+    std::size_t rows() const noexcept
+    {
+        return m_rows;
+    }
+
+    std::size_t columns() const noexcept
+    {
+        return m_columnCount;
+    }
+
+    const Column& column(std::size_t i) const noexcept
+    {
+        assert(i < m_columnCount);
+        return m_columns[i];
+    }
+
+    // все ли результаты выполнения получены
+    bool complete() const noexcept
+    {
+        return m_complete;
+    }
+
+    // сброс данных без освобождения памяти
+    void reset() noexcept
+    {
+        m_rows = 0;
+        m_columnCount = 0;
+        m_complete = false;
+    }
+
+private:
+    boost::system::error_code append(const ::PGresult* res)
+    {
+        const int nFields = ::PQnfields(res);
+        const int nTuples = ::PQntuples(res);
+
+        if (0 == m_rows && 0 == m_columnCount)
+        {
+            // первый результат порции задает схему, лишние колонки оставляем для следующих выполнений
+            if (m_columns.size() < std::size_t(nFields))
+                m_columns.resize(nFields);
+
+            m_columnCount = std::size_t(nFields);
+            for (int field = 0; field < nFields; ++field)
+                m_columns[field].reset(res, field);
+        }
+        else if (m_columnCount != std::size_t(nFields))
+        {
+            return make_error_code(PQError::RESULT_SCHEMA_MISMATCH);
+        }
+
+        for (int field = 0; field < nFields; ++field)
+        {
+            auto& col = m_columns[field];
+            if (col.type() != ::PQftype(res, field) || col.format() != ::PQfformat(res, field))
+                return make_error_code(PQError::RESULT_SCHEMA_MISMATCH);
+
+            // точный reserve только для целого набора строк: в построчном и порционном режимах он перевыделял бы
+            // и копировал колонку на каждой порции, рост там остается за геометрическим ростом push_back
+            if (PGRES_TUPLES_OK == ::PQresultStatus(res))
+                col.reserve(m_rows + nTuples);
+
+            // заполняем поколоночно, чтобы писать в один буфер подряд
+            for (int row = 0; row < nTuples; ++row)
+                col.append(res, row, field);
+        }
+
+        m_rows += std::size_t(nTuples);
+        return {};
+    }
+
+private:
+    std::vector<Column> m_columns;
+    std::size_t m_columnCount = 0;
+    std::size_t m_rows = 0;
+    bool m_complete = false;
+};
+
+} // namespace asiopq
+} // namespace ba
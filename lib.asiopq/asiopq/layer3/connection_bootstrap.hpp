@@ -0,0 +1,209 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../utility.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct PreparedStatement
+{
+    std::string name;
+    std::string query;
+    std::vector<Oid> types; // пусто - типы параметров выводит сервер
+};
+
+// Начальная настройка соединения, выполняется после каждого (пере)подключения до того, как соединение отдается операциям.
+// settings уходят в пакет запуска (options=-c имя=значение) и не стоят ни одного прохода до сервера,
+// statements и prepared отправляются одним конвейером, без поддержки конвейера в libpq - по очереди.
+struct ConnectionBootstrap
+{
+    std::map<std::string, std::string> settings; // GUC сессии: search_path, statement_timeout, application_name...
+    std::vector<std::string> statements; // команды без параметров, которые нельзя передать при запуске
+    std::vector<PreparedStatement> prepared;
+};
+
+namespace detail {
+
+// дописывает GUC к параметру options пакета запуска, пробелы и \ в нем экранируются обратной косой
+inline void addStartupSettings(std::map<std::string, std::string>& params, const std::map<std::string, std::string>& settings)
+{
+    if (settings.empty())
+        return;
+
+    std::string& options = params["options"];
+    for (const auto& setting : settings)
+    {
+        if (!options.empty())
+            options += ' ';
+        options += "-c ";
+
+        for (const char c : setting.first + '=' + setting.second)
+        {
+            if (' ' == c || '\\' == c)
+                options += '\\';
+            options += c;
+        }
+    }
+}
+
+// строка подключения (key=value или URI) в параметры для PQconnectStartParams
+inline std::map<std::string, std::string> parseConnectionParams(const std::string& conninfo)
+{
+    std::map<std::string, std::string> params;
+
+    const auto options = parseConnectionInfo(conninfo.c_str());
+    if (!options) // разбор не удался, пусть ошибку покажет само подключение
+    {
+        params["dbname"] = conninfo;
+        return params;
+    }
+
+    for (const PQconninfoOption* option = options.get(); option->keyword; ++option)
+        if (option->val)
+            params[option->keyword] = option->val;
+
+    return params;
+}
+
+// Команды начальной настройки на уже подключенном соединении.
+// При ошибке соединение закрывается: без настройки его нельзя отдавать операциям,
+// а закрытое пул с переподключением подключит заново.
+class BootstrapOperation
+{
+public:
+    explicit BootstrapOperation(std::shared_ptr<const ConnectionBootstrap> bootstrap)
+        : m_bootstrap{ std::move(bootstrap) }
+    {
+    }
+
+    template <typename Handler>
+    void operator()(Connection& conn, Handler&& handler) const
+    {
+        const auto& bootstrap = *m_bootstrap;
+        if (bootstrap.statements.empty() && bootstrap.prepared.empty())
+            return invokeHandler(std::forward<Handler>(handler), boost::system::error_code{});
+
+        auto onComplete = [&conn, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+            if (ec)
+                conn.close();
+
+            invokeHandler(std::move(handler), ec);
+        };
+
+#ifdef LIBPQ_HAS_PIPELINING
+        conn.asyncExecPipeline(
+              [pgConn{ conn.get() }, &bootstrap]{
+                if (!::PQenterPipelineMode(pgConn))
+                    return make_error_code(PQError::PIPELINE_FAILED);
+
+                for (const auto& statement : bootstrap.statements)
+                    if (!::PQsendQueryParams(pgConn, statement.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 0))
+                        return make_error_code(PQError::SEND_QUERY_PARAMS_FAILED);
+
+                for (const auto& prepared : bootstrap.prepared)
+                    if (!::PQsendPrepare(pgConn, prepared.name.c_str(), prepared.query.c_str(), int(prepared.types.size()), prepared.types.data()))
+                        return make_error_code(PQError::SEND_PREPARE_FAILED);
+
+                if (!::PQpipelineSync(pgConn))
+                    return make_error_code(PQError::PIPELINE_FAILED);
+
+                return boost::system::error_code{};
+              }
+            , 1
+            , std::move(onComplete)
+            );
+#else
+        step(conn, 0, std::move(onComplete));
+#endif
+    }
+
+private:
+#ifndef LIBPQ_HAS_PIPELINING
+    // шаг 0 - все statements одним простым запросом, далее по одной подготовке
+    template <typename Handler>
+    void step(Connection& conn, std::size_t index, Handler&& handler) const
+    {
+        const auto& bootstrap = *m_bootstrap;
+        if (0 == index && bootstrap.statements.empty())
+            ++index;
+        if (index > bootstrap.prepared.size())
+            return invokeHandler(std::forward<Handler>(handler), boost::system::error_code{});
+
+        auto next = [self{ *this }, &conn, index, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+            if (ec)
+                return invokeHandler(std::move(handler), ec);
+
+            self.step(conn, index + 1, std::move(handler));
+        };
+
+        if (0 == index)
+        {
+            conn.asyncExec(
+                  [pgConn{ conn.get() }, &bootstrap]{
+                    std::string command;
+                    for (const auto& statement : bootstrap.statements)
+                        command += statement + ";";
+
+                    if (!::PQsendQuery(pgConn, command.c_str()))
+                        return make_error_code(PQError::SEND_QUERY_FAILED);
+
+                    return boost::system::error_code{};
+                  }
+                , std::move(next)
+                );
+            return;
+        }
+
+        conn.asyncExec(
+              [pgConn{ conn.get() }, &prepared{ bootstrap.prepared[index - 1] }]{
+                if (!::PQsendPrepare(pgConn, prepared.name.c_str(), prepared.query.c_str(), int(prepared.types.size()), prepared.types.data()))
+                    return make_error_code(PQError::SEND_PREPARE_FAILED);
+
+                return boost::system::error_code{};
+              }
+            , std::move(next)
+            );
+    }
+#endif
+
+private:
+    std::shared_ptr<const ConnectionBootstrap> m_bootstrap; // общая для всех копий операции подключения
+};
+
+} // namespace detail
+
+// Операции подключения с начальной настройкой, для ReconnectionPool и makeCheckedOperation.
+// Хендлер получает успех только после выполнения всей настройки.
+// С expandDbname параметр options из строки в dbname заменяется собранным из settings.
+inline auto makeConnectOperation(std::map<std::string, std::string>&& params, ConnectionBootstrap bootstrap, bool expandDbname = false)
+{
+    detail::addStartupSettings(params, bootstrap.settings);
+
+    // не через оператор &: композиция переносит вторую операцию в хендлер, а операцию подключения пул вызывает многократно
+    return [
+          connect{ makeConnectOperation(std::move(params), expandDbname) }
+        , setup{ detail::BootstrapOperation{ std::make_shared<const ConnectionBootstrap>(std::move(bootstrap)) } }
+        ](Connection& conn, auto&& handler) {
+            connect(conn, [setup, &conn, handler{ std::forward<decltype(handler)>(handler) }](const boost::system::error_code& ec) mutable {
+                if (ec)
+                    return detail::invokeHandler(std::move(handler), ec);
+
+                setup(conn, std::move(handler));
+            });
+        };
+}
+
+inline auto makeConnectOperation(const std::string& conninfo, ConnectionBootstrap bootstrap)
+{
+    return makeConnectOperation(detail::parseConnectionParams(conninfo), std::move(bootstrap));
+}
+
+} // namespace asiopq
+} // namespace ba
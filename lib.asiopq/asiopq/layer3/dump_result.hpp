@@ -39,7 +39,7 @@ public:
 
         case PGRES_FATAL_ERROR:
             fprintf(m_fout, "%s", ::PQresultErrorMessage(res));
-            return make_error_code(PQError::RESULT_FATAL_ERROR);
+            return resultErrorCode(res);
 
         default:
             ::PQprint(m_fout, res, &m_opt);
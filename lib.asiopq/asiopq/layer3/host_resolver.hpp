@@ -0,0 +1,359 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+
+#include <boost/asio/ip/tcp.hpp>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct HostResolverOptions
+{
+    // getaddrinfo не сообщает TTL записей, поэтому срок жизни кеша задается явно
+    std::chrono::steady_clock::duration ttl = std::chrono::seconds{ 30 };
+    // при ошибке обновления отдаем устаревшие адреса, если они есть, не дольше этого срока
+    std::chrono::steady_clock::duration staleTtl = std::chrono::minutes{ 5 };
+};
+
+// Асинхронное разрешение имен через boost::asio::ip::tcp::resolver (getaddrinfo в служебном потоке asio)
+// с кешем адресов. Одновременные запросы одного имени объединяются в одно разрешение.
+// Создается только в std::shared_ptr (std::make_shared): разрешение держит его до завершения.
+// Потокобезопасен.
+class HostResolver
+    : public std::enable_shared_from_this<HostResolver>
+{
+public:
+    using Addresses = std::vector<std::string>;
+    using Waiter = std::function<void(const boost::system::error_code&, const Addresses&)>;
+
+    HostResolver(const HostResolver&) = delete;
+    HostResolver& operator=(const HostResolver&) = delete;
+
+    HostResolver(boost::asio::io_service& ios, HostResolverOptions options = {})
+        : m_resolver{ ios }
+        , m_options{ options }
+    {
+    }
+
+    // handler: void(const boost::system::error_code&, const Addresses&), вызывается через io_service, не из asyncResolve
+    void asyncResolve(const std::string& host, Waiter handler)
+    {
+        const auto now = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock{ m_mutex };
+
+        const auto found = m_cache.find(host);
+        if (found != m_cache.end() && found->second.expires > now)
+        {
+            Addresses addresses = found->second.addresses;
+            lock.unlock();
+
+            m_resolver.get_io_service().post([handler{ std::move(handler) }, addresses{ std::move(addresses) }]() {
+                handler(boost::system::error_code{}, addresses);
+            });
+            return;
+        }
+
+        auto& waiters = m_pending[host];
+        waiters.push_back(std::move(handler));
+        if (waiters.size() > 1)
+            return; // разрешение уже идет
+
+        m_resolver.async_resolve(
+              boost::asio::ip::tcp::resolver::query{ host, "" }
+            , [self{ shared_from_this() }, host](const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::iterator it) {
+                  Addresses addresses;
+                  for (; !ec && it != boost::asio::ip::tcp::resolver::iterator{}; ++it)
+                  {
+                      std::string address = it->endpoint().address().to_string();
+                      if (addresses.end() == std::find(addresses.begin(), addresses.end(), address))
+                          addresses.push_back(std::move(address));
+                  }
+
+                  self->complete(host, ec, std::move(addresses));
+              }
+            );
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_cache.clear();
+    }
+
+private:
+    struct Entry
+    {
+        Addresses addresses;
+        std::chrono::steady_clock::time_point expires;
+        std::chrono::steady_clock::time_point resolved;
+    };
+
+    void complete(const std::string& host, boost::system::error_code ec, Addresses addresses)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (!ec && addresses.empty())
+            ec = boost::asio::error::host_not_found;
+
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+
+            auto pending = m_pending.find(host);
+            waiters = std::move(pending->second);
+            m_pending.erase(pending);
+
+            auto& entry = m_cache[host];
+            if (!ec)
+            {
+                entry = Entry{ addresses, now + m_options.ttl, now };
+            }
+            else if (!entry.addresses.empty() && now - entry.resolved < m_options.staleTtl)
+            {
+                ec = {};
+                addresses = entry.addresses; // DNS недоступен, последние известные адреса лучше отказа
+            }
+            else
+            {
+                m_cache.erase(host);
+            }
+        }
+
+        for (const auto& waiter : waiters)
+            waiter(ec, addresses);
+    }
+
+private:
+    boost::asio::ip::tcp::resolver m_resolver;
+    const HostResolverOptions m_options;
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_cache;
+    std::map<std::string, std::vector<Waiter>> m_pending;
+};
+
+namespace detail {
+
+inline std::vector<std::string> splitConninfoList(const char* value)
+{
+    std::vector<std::string> result;
+    if (!value)
+        return result;
+
+    const char* begin = value;
+    for (;;)
+    {
+        const char* const end = std::strchr(begin, ',');
+        result.emplace_back(begin, end ? end : begin + std::strlen(begin));
+        if (!end)
+            return result;
+        begin = end + 1;
+    }
+}
+
+inline std::string joinConninfoList(const std::vector<std::string>& values)
+{
+    std::string result;
+    for (std::size_t i = 0; i != values.size(); ++i)
+    {
+        if (0 != i)
+            result += ',';
+        result += values[i];
+    }
+    return result;
+}
+
+using ConnectParams = std::map<std::string, std::string>;
+
+// Разбор conninfo в параметры, в которых имена хостов заменены адресами:
+// каждый адрес имени становится отдельным элементом списков host/hostaddr/port,
+// поэтому libpq перебирает их, как если бы они были перечислены в conninfo,
+// а host сохраняется для проверки сертификата и .pgpass
+class ConninfoResolution
+    : public std::enable_shared_from_this<ConninfoResolution>
+{
+public:
+    using Done = std::function<void(const boost::system::error_code&, ConnectParams&)>;
+
+    ConninfoResolution(boost::asio::io_service& ios, Done done)
+        : m_ios{ ios }
+        , m_done{ std::move(done) }
+    {
+    }
+
+    // done вызывается не из start
+    void start(HostResolver& resolver, const char* conninfo)
+    {
+        char* errmsg = nullptr;
+        std::unique_ptr<::PQconninfoOption, decltype(&::PQconninfoFree)> options{ ::PQconninfoParse(conninfo, &errmsg), ::PQconninfoFree };
+        if (errmsg)
+            ::PQfreemem(errmsg);
+
+        if (!options)
+            return finish(make_error_code(PQError::CONN_FAILED));
+
+        for (const auto* opt = options.get(); opt->keyword; ++opt)
+            if (opt->val)
+                m_params[opt->keyword] = opt->val;
+
+        const auto hostaddr = m_params.find("hostaddr");
+        const auto host = m_params.find("host");
+        if (hostaddr != m_params.end() || host == m_params.end())
+            return finish({}); // адреса заданы явно или подключение через сокет по умолчанию
+
+        m_hosts = splitConninfoList(host->second.c_str());
+        m_ports = splitConninfoList(m_params.count("port") ? m_params["port"].c_str() : nullptr);
+        m_resolved.resize(m_hosts.size());
+
+        std::vector<std::size_t> toResolve;
+        for (std::size_t i = 0; i != m_hosts.size(); ++i)
+        {
+            const auto& name = m_hosts[i];
+            if (name.empty() || '/' == name.front())
+            {
+                m_resolved[i].emplace_back(); // unix-сокет, пустой hostaddr
+                continue;
+            }
+
+            boost::system::error_code ec;
+            boost::asio::ip::address::from_string(name, ec);
+            if (!ec)
+                m_resolved[i].push_back(name); // уже адрес
+            else
+                toResolve.push_back(i);
+        }
+
+        m_remaining = toResolve.size();
+        if (0 == m_remaining)
+            return finish({});
+
+        for (const std::size_t i : toResolve)
+        {
+            resolver.asyncResolve(m_hosts[i], [self{ shared_from_this() }, i](const boost::system::error_code& ec, const HostResolver::Addresses& addresses) {
+                self->resolved(i, ec, addresses);
+            });
+        }
+    }
+
+private:
+    void resolved(std::size_t i, const boost::system::error_code& ec, const HostResolver::Addresses& addresses)
+    {
+        // вызовы из разных потоков resolver'а не пересекаются по i, счетчик общий
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            if (ec && !m_lastError)
+                m_lastError = ec;
+            if (!ec)
+                m_resolved[i] = addresses;
+            if (0 != --m_remaining)
+                return;
+        }
+
+        std::vector<std::string> hosts, hostaddrs, ports;
+        for (std::size_t h = 0; h != m_hosts.size(); ++h)
+        {
+            for (const auto& address : m_resolved[h])
+            {
+                hosts.push_back(m_hosts[h]);
+                hostaddrs.push_back(address);
+                if (!m_ports.empty())
+                    ports.push_back(m_ports.size() == m_hosts.size() ? m_ports[h] : m_ports.front());
+            }
+        }
+
+        if (hosts.empty()) // ни одно имя не разрешилось
+            return m_done(m_lastError, m_params);
+
+        m_params["host"] = joinConninfoList(hosts);
+        m_params["hostaddr"] = joinConninfoList(hostaddrs);
+        if (!ports.empty())
+            m_params["port"] = joinConninfoList(ports);
+
+        m_done({}, m_params);
+    }
+
+    void finish(const boost::system::error_code& ec)
+    {
+        m_ios.post([self{ shared_from_this() }, ec]() {
+            self->m_done(ec, self->m_params);
+        });
+    }
+
+private:
+    boost::asio::io_service& m_ios;
+    Done m_done;
+    ConnectParams m_params;
+    std::vector<std::string> m_hosts;
+    std::vector<std::string> m_ports;
+    std::vector<HostResolver::Addresses> m_resolved;
+    std::mutex m_mutex;
+    std::size_t m_remaining = 0;
+    boost::system::error_code m_lastError;
+};
+
+// PQconnectStartParams копирует параметры, после вызова они не нужны
+template <typename ConnectHandler>
+auto asyncConnectParams(Connection& conn, const ConnectParams& params, ConnectHandler&& handler)
+{
+    std::vector<const char*> keywords;
+    std::vector<const char*> values;
+    for (const auto& kv : params)
+    {
+        keywords.push_back(kv.first.c_str());
+        values.push_back(kv.second.c_str());
+    }
+    keywords.push_back(nullptr);
+    values.push_back(nullptr);
+
+    return conn.asyncConnectParams(keywords.data(), values.data(), 0, std::forward<ConnectHandler>(handler));
+}
+
+} // namespace detail
+
+// Как Connection::asyncConnect, но имена хостов разрешаются асинхронно через resolver,
+// и PQconnectStart не выполняет блокирующий getaddrinfo в потоке io_service.
+// Если в conninfo уже есть hostaddr, разрешение не выполняется.
+template <typename ConnectHandler>
+auto asyncConnectResolved(Connection& conn, const std::shared_ptr<HostResolver>& resolver, const char* conninfo, ConnectHandler&& handler)
+{
+    detail::async_result_init<ConnectHandler, void(boost::system::error_code)>
+        init{ std::forward<ConnectHandler>(handler) };
+
+    // скрываем реальный тип хендлера, init.result.get() вызывается только здесь
+    auto hiddenHandler = [handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+        detail::invokeHandler(std::move(handler), ec);
+    };
+
+    std::make_shared<detail::ConninfoResolution>(
+          conn.get_io_service()
+        , [&conn, hiddenHandler{ std::move(hiddenHandler) }](const boost::system::error_code& ec, detail::ConnectParams& params) mutable {
+              if (ec)
+                  return hiddenHandler(ec);
+
+              detail::asyncConnectParams(conn, params, std::move(hiddenHandler));
+          }
+        )->start(*resolver, conninfo);
+
+    return init.result.get();
+}
+
+// операция подключения для ReconnectionPool с асинхронным разрешением имен
+inline auto makeConnectOperation(std::string&& conninfo, std::shared_ptr<HostResolver> resolver)
+{
+    return [conninfo{ std::move(conninfo) }, resolver{ std::move(resolver) }](Connection& conn, auto&& handler) {
+        asyncConnectResolved(conn, resolver, conninfo.c_str(), std::forward<decltype(handler)>(handler));
+    };
+}
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <boost/asio/strand.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include "host_resolver.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct RacingConnectOptions
+{
+    // задержка перед запуском следующей попытки, если предыдущие еще не завершились
+    boost::posix_time::time_duration stagger = boost::posix_time::milliseconds{ 250 };
+};
+
+namespace detail {
+
+// по одному набору параметров на каждую пару host/hostaddr/port
+inline std::vector<ConnectParams> splitConnectCandidates(const ConnectParams& params)
+{
+    const auto list = [&params](const char* keyword) {
+        const auto found = params.find(keyword);
+        return found == params.end() ? std::vector<std::string>{} : splitConninfoList(found->second.c_str());
+    };
+
+    const auto hosts = list("host");
+    const auto hostaddrs = list("hostaddr");
+    const auto ports = list("port");
+    const std::size_t n = std::max(hosts.size(), hostaddrs.size());
+
+    std::vector<ConnectParams> candidates;
+    if (n <= 1)
+    {
+        candidates.push_back(params);
+        return candidates;
+    }
+
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        candidates.push_back(params);
+        auto& candidate = candidates.back();
+        if (hosts.size() == n)
+            candidate["host"] = hosts[i];
+        if (hostaddrs.size() == n)
+            candidate["hostaddr"] = hostaddrs[i];
+        if (ports.size() == n)
+            candidate["port"] = ports[i];
+    }
+
+    return candidates;
+}
+
+// Попытки подключения к кандидатам запускаются с интервалом stagger или сразу после неудачи предыдущей,
+// первая успешная передается в целевое соединение, остальные прерываются
+class ConnectRace
+    : public std::enable_shared_from_this<ConnectRace>
+{
+public:
+    using Handler = std::function<void(const boost::system::error_code&)>;
+
+    ConnectRace(Connection& conn, const RacingConnectOptions& options, Handler handler)
+        : m_conn{ conn }
+        , m_strand{ conn.get_io_service() }
+        , m_timer{ conn.get_io_service() }
+        , m_options{ options }
+        , m_handler{ std::move(handler) }
+    {
+    }
+
+    void fail(const boost::system::error_code& ec)
+    {
+        m_strand.dispatch([self{ shared_from_this() }, ec]() {
+            self->finish(ec);
+        });
+    }
+
+    void start(std::vector<ConnectParams> candidates)
+    {
+        m_candidates = std::move(candidates);
+        m_attempts.resize(m_candidates.size());
+        m_strand.dispatch([self{ shared_from_this() }]() {
+            self->launchNext();
+        });
+    }
+
+private:
+    void launchNext()
+    {
+        if (m_finished || m_next == m_candidates.size())
+            return;
+
+        const std::size_t i = m_next++;
+        auto attempt = std::make_shared<Connection>(m_conn.get_io_service());
+        m_attempts[i] = attempt;
+        ++m_running;
+
+        asyncConnectParams(*attempt, m_candidates[i], m_strand.wrap([self{ shared_from_this() }, i, attempt](const boost::system::error_code& ec) {
+            self->attemptDone(i, ec);
+        }));
+
+        if (m_next == m_candidates.size())
+            return;
+
+        m_timer.expires_from_now(m_options.stagger);
+        m_timer.async_wait(m_strand.wrap([self{ shared_from_this() }, generation{ ++m_generation }](const boost::system::error_code& ec) {
+            if (!ec && generation == self->m_generation)
+                self->launchNext();
+        }));
+    }
+
+    void attemptDone(std::size_t i, const boost::system::error_code& ec)
+    {
+        --m_running;
+        auto attempt = std::move(m_attempts[i]);
+
+        if (m_finished)
+            return; // проигравшая попытка, соединение закроется вместе с attempt
+
+        if (ec)
+        {
+            m_lastError = ec;
+            if (0 == m_running && m_next == m_candidates.size())
+                return finish(m_lastError);
+
+            return launchNext(); // не ждем stagger, пробуем следующего сразу
+        }
+
+        m_conn.adopt(std::move(*attempt));
+
+        for (const auto& other : m_attempts)
+            if (other)
+                other->cancelConnect();
+
+        finish({});
+    }
+
+    void finish(const boost::system::error_code& ec)
+    {
+        m_finished = true;
+        ++m_generation;
+        boost::system::error_code ignoreEc;
+        m_timer.cancel(ignoreEc);
+
+        m_conn.get_io_service().post([handler{ std::move(m_handler) }, ec]() {
+            handler(ec);
+        });
+    }
+
+private:
+    Connection& m_conn;
+    boost::asio::io_service::strand m_strand;
+    boost::asio::deadline_timer m_timer;
+    const RacingConnectOptions m_options;
+    Handler m_handler;
+    std::vector<ConnectParams> m_candidates;
+    std::vector<std::shared_ptr<Connection>> m_attempts;
+    std::size_t m_next = 0;
+    std::size_t m_running = 0;
+    unsigned m_generation = 0;
+    bool m_finished = false;
+    boost::system::error_code m_lastError;
+};
+
+} // namespace detail
+
+// Подключение к первому ответившему из нескольких хостов conninfo или адресов одного имени.
+// Имена разрешаются через resolver (см. asyncConnectResolved), затем к каждому кандидату
+// идет отдельная попытка с тем же target_session_attrs, libpq сама проверяет его для каждой.
+// Порядок перечисления хостов сохраняется только как порядок запуска попыток,
+// поэтому prefer-standby ведет себя как any.
+// conn не должен использоваться до вызова хендлера.
+template <typename ConnectHandler>
+auto asyncConnectRacing(
+      Connection& conn
+    , const std::shared_ptr<HostResolver>& resolver
+    , const char* conninfo
+    , ConnectHandler&& handler
+    , const RacingConnectOptions& options = {}
+    )
+{
+    detail::async_result_init<ConnectHandler, void(boost::system::error_code)>
+        init{ std::forward<ConnectHandler>(handler) };
+
+    // скрываем реальный тип хендлера, init.result.get() вызывается только здесь
+    auto race = std::make_shared<detail::ConnectRace>(
+          conn
+        , options
+        , [handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+              detail::invokeHandler(std::move(handler), ec);
+          }
+        );
+
+    std::make_shared<detail::ConninfoResolution>(
+          conn.get_io_service()
+        , [race](const boost::system::error_code& ec, detail::ConnectParams& params) {
+              if (ec)
+                  race->fail(ec);
+              else
+                  race->start(detail::splitConnectCandidates(params));
+          }
+        )->start(*resolver, conninfo);
+
+    return init.result.get();
+}
+
+// операция подключения для ReconnectionPool с параллельными попытками
+inline auto makeRacingConnectOperation(std::string&& conninfo, std::shared_ptr<HostResolver> resolver, RacingConnectOptions options = {})
+{
+    return [conninfo{ std::move(conninfo) }, resolver{ std::move(resolver) }, options](Connection& conn, auto&& handler) {
+        asyncConnectRacing(conn, resolver, conninfo.c_str(), std::forward<decltype(handler)>(handler), options);
+    };
+}
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include <boost/utility/string_view.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include <libpq-fe.h>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+
+namespace ba {
+namespace asiopq {
+
+// LSN в текстовом виде сервера: "16/B374D848"
+inline std::string formatLsn(std::uint64_t lsn)
+{
+    char buffer[24];
+    std::snprintf(buffer, sizeof(buffer), "%X/%X", unsigned(lsn >> 32), unsigned(lsn & 0xFFFFFFFF));
+    return buffer;
+}
+
+// 0 - если строка не LSN
+inline std::uint64_t parseLsn(const char* text)
+{
+    unsigned high = 0;
+    unsigned low = 0;
+    if (2 != std::sscanf(text, "%X/%X", &high, &low))
+        return 0;
+
+    return (std::uint64_t(high) << 32) | low;
+}
+
+struct ReplicationOptions
+{
+    std::string slot; // логический слот, должен существовать
+    std::uint64_t startLsn = 0; // 0 - с confirmed_flush_lsn слота
+    std::vector<std::pair<std::string, std::string>> pluginOptions; // например { "proto_version", "1" }, { "publication_names", "pub" }
+    boost::posix_time::time_duration statusInterval = boost::posix_time::seconds{ 10 }; // меньше wal_sender_timeout
+    std::size_t maxBatch = 1'000; // сообщений за один вызов хендлера чтения
+};
+
+// Сообщение XLogData, data - вывод плагина декодирования как есть
+struct ReplicationMessage
+{
+    std::uint64_t walStart;
+    std::uint64_t walEnd;
+    std::int64_t sendTime; // микросекунды от 2000-01-01 по часам сервера
+    boost::string_view data;
+};
+
+// Пачка сообщений, действительна до следующего asyncRead (или удаления потока)
+class ReplicationBatch
+{
+public:
+    ReplicationBatch() = default;
+
+    ReplicationBatch(const ReplicationMessage* begin, std::size_t size) noexcept
+        : m_begin{ begin }
+        , m_size{ size }
+    {
+    }
+
+    const ReplicationMessage* begin() const noexcept
+    {
+        return m_begin;
+    }
+
+    const ReplicationMessage* end() const noexcept
+    {
+        return m_begin + m_size;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+    bool empty() const noexcept
+    {
+        return 0 == m_size;
+    }
+
+    const ReplicationMessage& operator[](std::size_t i) const noexcept
+    {
+        return m_begin[i];
+    }
+
+private:
+    const ReplicationMessage* m_begin = nullptr;
+    std::size_t m_size = 0;
+};
+
+namespace detail {
+
+inline std::uint64_t readBigEndian64(const char* data) noexcept
+{
+    std::uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    return value;
+}
+
+inline void writeBigEndian64(char* data, std::uint64_t value) noexcept
+{
+    for (int i = 7; i >= 0; --i, value >>= 8)
+        data[i] = char(value & 0xFF);
+}
+
+// микросекунды от эпохи PostgreSQL (2000-01-01)
+inline std::int64_t replicationNow() noexcept
+{
+    constexpr std::int64_t POSTGRES_EPOCH_US = 946'684'800'000'000;
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count() - POSTGRES_EPOCH_US;
+}
+
+struct FreeCopyData
+{
+    void operator()(char* buffer) const noexcept
+    {
+        ::PQfreemem(buffer);
+    }
+};
+
+} // namespace detail
+
+// Потребитель логической репликации поверх Connection, подключенного с replication=database.
+// asyncStart выполняет START_REPLICATION, после чего asyncRead отдает пачки сообщений XLogData.
+// Сокет читается только пока ждет asyncRead: не успевающий потребитель не копит данные в памяти,
+// сервер упирается в TCP. Пока asyncRead не вызван, буферы libpq предыдущей пачки не освобождаются.
+// Состояние подтверждения (acknowledge) отправляется серверу по таймеру statusInterval и по его запросу.
+// Одновременно допускается один asyncRead. Объект и соединение должны жить, пока не завершатся
+// все операции (после stop таймер снимается, ожидающий asyncRead завершится с ошибкой при закрытии соединения).
+class ReplicationStream
+{
+public:
+    ReplicationStream(const ReplicationStream&) = delete;
+    ReplicationStream& operator=(const ReplicationStream&) = delete;
+
+    ReplicationStream(Connection& conn, ReplicationOptions options)
+        : m_conn{ conn }
+        , m_strand{ conn.get_io_service() }
+        , m_timer{ conn.get_io_service() }
+        , m_options{ std::move(options) }
+    {
+        if (0 == m_options.maxBatch)
+            throw std::invalid_argument("ReplicationStream maxBatch can't be zero");
+
+        m_messages.reserve(m_options.maxBatch);
+        m_buffers.reserve(m_options.maxBatch);
+    }
+
+    template <typename Handler>
+    auto asyncStart(Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        m_command = makeCommand();
+        m_conn.asyncExec(
+              [pgConn{ m_conn.get() }, command{ m_command.c_str() }]{
+                if (!*command || !::PQsendQuery(pgConn, command))
+                    return make_error_code(PQError::SEND_QUERY_FAILED);
+
+                return boost::system::error_code{};
+              }
+            , m_strand.wrap([this, handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+                  if (!ec)
+                      armStatusTimer();
+
+                  m_strand.get_io_service().post([handler{ std::move(handler) }, ec]() mutable {
+                      detail::invokeHandler(std::move(handler), ec);
+                  });
+              })
+            );
+
+        return init.result.get();
+    }
+
+    // Хендлер: void(const boost::system::error_code&, ReplicationBatch).
+    // Пачка не пуста при успехе, boost::asio::error::eof - сервер завершил поток (в пачке могут быть последние сообщения)
+    template <typename Handler>
+    auto asyncRead(Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, ReplicationBatch)>
+            init{ std::forward<Handler>(handler) };
+
+        m_strand.dispatch([this, handler{ std::move(init.handler) }]() mutable {
+            assert(!m_reader && "ReplicationStream allows only one asyncRead at a time");
+            m_reader = std::move(handler);
+
+            // предыдущая пачка больше не нужна вызывающему
+            m_messages.clear();
+            m_buffers.clear();
+
+            read();
+        });
+
+        return init.result.get();
+    }
+
+    // Все сообщения до lsn включительно обработаны, слот может освободить WAL.
+    // Потокобезопасен, сервер узнает об этом со следующим состоянием.
+    void acknowledge(std::uint64_t lsn)
+    {
+        m_strand.dispatch([this, lsn]() {
+            m_flushed = std::max(m_flushed, lsn);
+        });
+    }
+
+    void stop()
+    {
+        m_strand.dispatch([this]() {
+            m_stopped = true;
+            boost::system::error_code ignoreEc;
+            m_timer.cancel(ignoreEc);
+        });
+    }
+
+private:
+    std::string makeCommand()
+    {
+        PGconn* const pgConn = m_conn.get();
+        if (!pgConn)
+            return {};
+
+        const auto escape = [pgConn](const std::string& value, auto escapeFunction) {
+            char* const escaped = escapeFunction(pgConn, value.c_str(), value.size());
+            if (!escaped)
+                return std::string{};
+
+            std::string result{ escaped };
+            ::PQfreemem(escaped);
+            return result;
+        };
+
+        const std::string slot = escape(m_options.slot, ::PQescapeIdentifier);
+        if (slot.empty())
+            return {};
+
+        std::string command = "START_REPLICATION SLOT " + slot + " LOGICAL " + formatLsn(m_options.startLsn);
+        for (std::size_t i = 0; i != m_options.pluginOptions.size(); ++i)
+        {
+            const std::string name = escape(m_options.pluginOptions[i].first, ::PQescapeIdentifier);
+            const std::string value = escape(m_options.pluginOptions[i].second, ::PQescapeLiteral);
+            if (name.empty() || value.empty())
+                return {};
+
+            command += 0 == i ? " (" : ", ";
+            command += name + ' ' + value;
+        }
+        if (!m_options.pluginOptions.empty())
+            command += ')';
+
+        return command;
+    }
+
+    // все ниже исполняется в m_strand
+
+    void read()
+    {
+        PGconn* const pgConn = m_conn.get();
+
+        for (;;)
+        {
+            if (m_statusEc)
+                return deliver(m_statusEc);
+
+            char* buffer = nullptr;
+            const int size = ::PQgetCopyData(pgConn, &buffer, 1); // без блокирования
+            if (size > 0)
+            {
+                onMessage(std::unique_ptr<char, detail::FreeCopyData>{ buffer }, std::size_t(size));
+                if (m_messages.size() >= m_options.maxBatch)
+                    return deliver({});
+                continue;
+            }
+
+            if (0 == size) // целого сообщения в буфере libpq нет
+            {
+                if (!m_messages.empty())
+                    return deliver({}); // не держим готовые сообщения ради полной пачки
+
+                return m_conn.asyncWaitReading(m_strand.wrap([this](const boost::system::error_code& ec) {
+                    if (ec) // закрытый сокет libpq не заметит, ждали бы вечно
+                        return deliver(ec);
+
+                    if (!::PQconsumeInput(m_conn.get()))
+                        return deliver(make_error_code(PQError::CONSUME_INPUT_FAILED));
+
+                    read();
+                }));
+            }
+
+            if (-1 == size) // сервер завершил COPY, сообщение об ошибке может уже лежать в результате
+            {
+                boost::system::error_code ec = boost::asio::error::eof;
+                if (!::PQisBusy(pgConn))
+                {
+                    if (::PGresult* res = ::PQgetResult(pgConn))
+                    {
+                        if (PGRES_FATAL_ERROR == ::PQresultStatus(res))
+                            ec = resultErrorCode(res);
+                        ::PQclear(res);
+                    }
+                }
+                return deliver(ec);
+            }
+
+            return deliver(make_error_code(PQError::COPY_DATA_FAILED));
+        }
+    }
+
+    void onMessage(std::unique_ptr<char, detail::FreeCopyData> buffer, std::size_t size)
+    {
+        const char* const data = buffer.get();
+        switch (data[0])
+        {
+        case 'w': // XLogData: walStart, walEnd, sendTime, данные
+            if (size < 25)
+                return;
+
+            m_messages.push_back(ReplicationMessage{
+                  detail::readBigEndian64(data + 1)
+                , detail::readBigEndian64(data + 9)
+                , std::int64_t(detail::readBigEndian64(data + 17))
+                , boost::string_view{ data + 25, size - 25 }
+                });
+            m_received = std::max(m_received, m_messages.back().walStart);
+            m_buffers.push_back(std::move(buffer));
+            return;
+
+        case 'k': // keepalive: walEnd, sendTime, нужен ли ответ
+            if (size >= 18 && 0 != data[17])
+                sendStatus();
+            return;
+
+        default:
+            return;
+        }
+    }
+
+    void deliver(const boost::system::error_code& ec)
+    {
+        auto reader = std::move(m_reader);
+        m_reader = nullptr;
+
+        m_strand.get_io_service().post([reader{ std::move(reader) }, ec, batch{ ReplicationBatch{ m_messages.data(), m_messages.size() } }]() mutable {
+            detail::invokeHandler(std::move(reader), ec, batch);
+        });
+    }
+
+    // Standby status update: write, flush, apply, время клиента, ответ не нужен
+    void sendStatus()
+    {
+        char message[34];
+        message[0] = 'r';
+        detail::writeBigEndian64(message + 1, m_received);
+        detail::writeBigEndian64(message + 9, m_flushed);
+        detail::writeBigEndian64(message + 17, m_flushed);
+        detail::writeBigEndian64(message + 25, std::uint64_t(detail::replicationNow()));
+        message[33] = 0;
+
+        if (1 != ::PQputCopyData(m_conn.get(), message, int(sizeof(message))) || ::PQflush(m_conn.get()) < 0)
+            m_statusEc = make_error_code(PQError::COPY_DATA_FAILED); // отдадим со следующей пачкой
+    }
+
+    void armStatusTimer()
+    {
+        if (m_stopped)
+            return;
+
+        m_timer.expires_from_now(m_options.statusInterval);
+        m_timer.async_wait(m_strand.wrap([this](const boost::system::error_code& ec) {
+            if (ec || m_stopped)
+                return;
+
+            sendStatus();
+            armStatusTimer();
+        }));
+    }
+
+private:
+    Connection& m_conn;
+    boost::asio::io_service::strand m_strand;
+    boost::asio::deadline_timer m_timer;
+    const ReplicationOptions m_options;
+    std::string m_command;
+
+    std::function<void(const boost::system::error_code&, ReplicationBatch)> m_reader;
+    std::vector<ReplicationMessage> m_messages; // текущая пачка
+    std::vector<std::unique_ptr<char, detail::FreeCopyData>> m_buffers; // буферы PQgetCopyData под m_messages
+
+    std::uint64_t m_received = 0; // начало последнего полученного сообщения
+    std::uint64_t m_flushed = 0;  // подтверждено вызывающим
+    boost::system::error_code m_statusEc;
+    bool m_stopped = false;
+};
+
+} // namespace asiopq
+} // namespace ba
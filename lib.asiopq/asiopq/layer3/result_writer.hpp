@@ -0,0 +1,614 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <libpq-fe.h>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BA_ASIOPQ_HAS_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include "../error.hpp"
+#include "columnar_result.hpp"
+
+namespace ba {
+namespace asiopq {
+
+namespace detail {
+
+constexpr Oid JSON_OID = 114;
+constexpr Oid NUMERIC_OID = 1700;
+constexpr Oid JSONB_OID = 3802;
+
+#ifdef BA_ASIOPQ_HAS_SSE2
+inline unsigned firstSetBit(unsigned mask) noexcept
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return unsigned(index);
+#else
+    return unsigned(__builtin_ctz(mask));
+#endif
+}
+#endif
+
+// длина начала значения, которое можно записать в CSV как есть (без кавычек)
+inline std::size_t csvPlainPrefix(const char* data, std::size_t size, char delimiter) noexcept
+{
+    std::size_t i = 0;
+#ifdef BA_ASIOPQ_HAS_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i delim = _mm_set1_epi8(delimiter);
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const __m128i special = _mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, delim))
+            , _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf))
+            );
+        if (const unsigned mask = unsigned(_mm_movemask_epi8(special)))
+            return i + firstSetBit(mask);
+    }
+#endif
+    for (; i < size; ++i)
+    {
+        const char c = data[i];
+        if ('"' == c || delimiter == c || '\r' == c || '\n' == c)
+            return i;
+    }
+    return size;
+}
+
+// длина начала значения, которое можно записать в строку JSON без экранирования
+inline std::size_t jsonPlainPrefix(const char* data, std::size_t size) noexcept
+{
+    std::size_t i = 0;
+#ifdef BA_ASIOPQ_HAS_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i maxControl = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, maxControl), maxControl); // v <= 0x1F без знака
+        const __m128i special = _mm_or_si128(control, _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+        if (const unsigned mask = unsigned(_mm_movemask_epi8(special)))
+            return i + firstSetBit(mask);
+    }
+#endif
+    for (; i < size; ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        if ('"' == c || '\\' == c || c < 0x20)
+            return i;
+    }
+    return size;
+}
+
+// Выходной буфер из блоков постоянного размера: блоки не перевыделяются при росте
+// и отдаются приемнику одной сборной записью, после сброса переиспользуются
+class OutputBuffer
+{
+public:
+    static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+
+    std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+    void append(char c)
+    {
+        if (m_chunks.empty() || CHUNK_SIZE == m_used)
+            nextChunk();
+
+        m_chunks[m_current][m_used++] = c;
+        ++m_size;
+    }
+
+    void append(const char* data, std::size_t size)
+    {
+        while (0 != size)
+        {
+            if (m_chunks.empty() || CHUNK_SIZE == m_used)
+                nextChunk();
+
+            const std::size_t n = std::min(size, CHUNK_SIZE - m_used);
+            std::memcpy(m_chunks[m_current].get() + m_used, data, n);
+            m_used += n;
+            m_size += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    // sink: boost::system::error_code(const std::vector<boost::asio::const_buffer>&)
+    template <typename Sink>
+    boost::system::error_code flush(Sink& sink)
+    {
+        if (0 == m_size)
+            return {};
+
+        m_buffers.clear();
+        for (std::size_t i = 0; i < m_current; ++i)
+            m_buffers.emplace_back(m_chunks[i].get(), CHUNK_SIZE);
+        m_buffers.emplace_back(m_chunks[m_current].get(), m_used);
+
+        m_current = 0;
+        m_used = 0;
+        m_size = 0;
+        return sink.write(m_buffers);
+    }
+
+private:
+    void nextChunk()
+    {
+        if (!m_chunks.empty())
+            ++m_current;
+        if (m_current == m_chunks.size())
+            m_chunks.emplace_back(new char[CHUNK_SIZE]);
+        m_used = 0;
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    std::vector<boost::asio::const_buffer> m_buffers;
+    std::size_t m_current = 0; // текущий блок
+    std::size_t m_used = 0;    // занято в текущем блоке
+    std::size_t m_size = 0;
+};
+
+inline void appendHex(OutputBuffer& out, const char* data, std::size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    out.append("\\x", 2);
+    for (std::size_t i = 0; i != size; ++i)
+    {
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        out.append(digits[c >> 4]);
+        out.append(digits[c & 0xF]);
+    }
+}
+
+inline void appendJsonString(OutputBuffer& out, const char* data, std::size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    out.append('"');
+    for (;;)
+    {
+        const std::size_t plain = jsonPlainPrefix(data, size);
+        out.append(data, plain);
+        data += plain;
+        size -= plain;
+        if (0 == size)
+            break;
+
+        const unsigned char c = static_cast<unsigned char>(*data++);
+        --size;
+        switch (c)
+        {
+        case '"': out.append("\\\"", 2); break;
+        case '\\': out.append("\\\\", 2); break;
+        case '\n': out.append("\\n", 2); break;
+        case '\r': out.append("\\r", 2); break;
+        case '\t': out.append("\\t", 2); break;
+        case '\b': out.append("\\b", 2); break;
+        case '\f': out.append("\\f", 2); break;
+        default:
+            out.append("\\u00", 4);
+            out.append(digits[c >> 4]);
+            out.append(digits[c & 0xF]);
+        }
+    }
+    out.append('"');
+}
+
+// Общая часть сериализующих коллекторов: разбор статусов, однострочный режим, сброс буфера в приемник.
+// Format::writeRows(out, res, first) дописывает строки результата, first - первая порция очередного набора строк.
+// Набор заканчивается PGRES_TUPLES_OK: в обычном режиме это весь набор, в однострочном и порционном - пустой завершающий.
+template <typename Format, typename Sink>
+class ResultWriter
+{
+public:
+    ResultWriter(Sink&& sink, std::size_t flushBytes)
+        : m_sink{ std::move(sink) }
+        , m_flushBytes{ flushBytes }
+    {
+    }
+
+    boost::system::error_code operator()(const ::PGresult* res)
+    {
+        if (!res) // конец данных выполнения, отдаем все накопленное; после него коллектор можно использовать заново
+        {
+            const auto ec = m_error ? m_error : m_out.flush(m_sink);
+            m_error = {};
+            m_started = false;
+            return ec;
+        }
+
+        if (m_error)
+            return m_error; // приемник уже отказал, остаток выполнения только вычитываем
+
+        switch (::PQresultStatus(res))
+        {
+        case PGRES_BAD_RESPONSE:
+            return make_error_code(PQError::RESULT_BAD_RESPONSE);
+        case PGRES_FATAL_ERROR:
+            return resultErrorCode(res);
+        case PGRES_TUPLES_OK:
+        case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK:
+#endif
+            break;
+        default:
+            return {}; // команды без данных пропускаем
+        }
+
+        static_cast<Format*>(this)->writeRows(m_out, res, !m_started);
+        m_started = PGRES_TUPLES_OK != ::PQresultStatus(res); // следующий набор (многооператорный запрос) начинается заново
+
+        if (m_out.size() >= m_flushBytes)
+            return fail(m_out.flush(m_sink));
+
+        return {};
+    }
+
+private:
+    boost::system::error_code fail(const boost::system::error_code& ec)
+    {
+        m_error = ec;
+        return ec;
+    }
+
+private:
+    Sink m_sink;
+    const std::size_t m_flushBytes;
+    OutputBuffer m_out;
+    bool m_started = false;
+    boost::system::error_code m_error;
+};
+
+} // namespace detail
+
+#ifndef _WIN32
+// Приемник в файловый дескриптор (файл, pipe), блоки буфера уходят одним writev.
+// Дескриптор должен быть блокирующим.
+class FdSink
+{
+public:
+    explicit FdSink(int fd) noexcept
+        : m_fd{ fd }
+    {
+    }
+
+    boost::system::error_code write(const std::vector<boost::asio::const_buffer>& buffers)
+    {
+        m_iov.clear();
+        for (const auto& buffer : buffers)
+            m_iov.push_back(::iovec{ const_cast<void*>(boost::asio::buffer_cast<const void*>(buffer)), boost::asio::buffer_size(buffer) });
+
+        std::size_t first = 0;
+        while (first != m_iov.size())
+        {
+            const int count = int(std::min<std::size_t>(m_iov.size() - first, IOV_MAX));
+            const ssize_t written = ::writev(m_fd, m_iov.data() + first, count);
+            if (written < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                return { errno, boost::system::system_category() };
+            }
+
+            // частичная запись: пропускаем записанные блоки, от недописанного оставляем хвост
+            std::size_t rest = std::size_t(written);
+            while (first != m_iov.size() && rest >= m_iov[first].iov_len)
+                rest -= m_iov[first++].iov_len;
+            if (0 != rest)
+            {
+                m_iov[first].iov_base = static_cast<char*>(m_iov[first].iov_base) + rest;
+                m_iov[first].iov_len -= rest;
+            }
+        }
+
+        return {};
+    }
+
+private:
+    int m_fd;
+    std::vector<::iovec> m_iov;
+};
+#endif
+
+// Приемник в синхронный поток asio (сокет, serial_port и т.п.) сборной записью boost::asio::write.
+// Запись блокирует поток, в котором выполняется коллектор, на время отправки.
+template <typename SyncWriteStream>
+class StreamSink
+{
+public:
+    explicit StreamSink(SyncWriteStream& stream) noexcept
+        : m_stream{ &stream }
+    {
+    }
+
+    boost::system::error_code write(const std::vector<boost::asio::const_buffer>& buffers)
+    {
+        boost::system::error_code ec;
+        boost::asio::write(*m_stream, buffers, ec);
+        return ec;
+    }
+
+private:
+    SyncWriteStream* m_stream;
+};
+
+struct CsvOptions
+{
+    char delimiter = ',';
+    bool header = true; // имена колонок перед первой строкой каждого выполнения
+    bool crlf = true;   // конец строки по RFC 4180, false - '\n'
+    std::size_t flushBytes = 1024 * 1024;
+};
+
+// Коллектор, пишущий результаты в CSV по RFC 4180 вместо PQprint, в том числе поток PGRES_SINGLE_TUPLE.
+// NULL - пустое поле, пустая строка - "", значения в двоичном формате - \x и hex.
+// Буфер переиспользуется между выполнениями, поэтому коллектор лучше передавать в asyncExec по lvalue-ссылке.
+template <typename Sink>
+class CsvWriter
+    : public detail::ResultWriter<CsvWriter<Sink>, Sink>
+{
+public:
+    explicit CsvWriter(Sink sink, const CsvOptions& options = {})
+        : detail::ResultWriter<CsvWriter<Sink>, Sink>{ std::move(sink), options.flushBytes }
+        , m_options{ options }
+    {
+    }
+
+    void writeRows(detail::OutputBuffer& out, const ::PGresult* res, bool first)
+    {
+        const int nFields = ::PQnfields(res);
+        const int nTuples = ::PQntuples(res);
+
+        if (first && m_options.header)
+        {
+            for (int field = 0; field < nFields; ++field)
+            {
+                if (0 != field)
+                    out.append(m_options.delimiter);
+                const char* const name = ::PQfname(res, field);
+                appendField(out, name, std::strlen(name));
+            }
+            endLine(out);
+        }
+
+        for (int row = 0; row < nTuples; ++row)
+        {
+            for (int field = 0; field < nFields; ++field)
+            {
+                if (0 != field)
+                    out.append(m_options.delimiter);
+                if (::PQgetisnull(res, row, field))
+                    continue;
+
+                const char* const value = ::PQgetvalue(res, row, field);
+                const std::size_t length = std::size_t(::PQgetlength(res, row, field));
+                if (1 == ::PQfformat(res, field))
+                    detail::appendHex(out, value, length);
+                else
+                    appendField(out, value, length);
+            }
+            endLine(out);
+        }
+    }
+
+private:
+    void appendField(detail::OutputBuffer& out, const char* data, std::size_t size)
+    {
+        if (0 != size && size == detail::csvPlainPrefix(data, size, m_options.delimiter))
+            return out.append(data, size);
+
+        // в кавычках, кавычки внутри удваиваются
+        out.append('"');
+        while (const char* const quote = static_cast<const char*>(std::memchr(data, '"', size)))
+        {
+            const std::size_t n = std::size_t(quote - data) + 1;
+            out.append(data, n);
+            out.append('"');
+            data += n;
+            size -= n;
+        }
+        out.append(data, size);
+        out.append('"');
+    }
+
+    void endLine(detail::OutputBuffer& out)
+    {
+        if (m_options.crlf)
+            out.append("\r\n", 2);
+        else
+            out.append('\n');
+    }
+
+private:
+    const CsvOptions m_options;
+};
+
+struct JsonLinesOptions
+{
+    std::size_t flushBytes = 1024 * 1024;
+};
+
+// Коллектор, пишущий каждую строку результата объектом JSON в отдельной строке (JSON Lines).
+// Числа, bool, json и jsonb выводятся как есть (NaN и Infinity - строками), NULL - null, остальное - строками,
+// двоичный формат - строкой \x и hex. Соединение должно работать в client_encoding UTF8.
+template <typename Sink>
+class JsonLinesWriter
+    : public detail::ResultWriter<JsonLinesWriter<Sink>, Sink>
+{
+public:
+    explicit JsonLinesWriter(Sink sink, const JsonLinesOptions& options = {})
+        : detail::ResultWriter<JsonLinesWriter<Sink>, Sink>{ std::move(sink), options.flushBytes }
+    {
+    }
+
+    void writeRows(detail::OutputBuffer& out, const ::PGresult* res, bool first)
+    {
+        const int nFields = ::PQnfields(res);
+        const int nTuples = ::PQntuples(res);
+
+        if (first) // ключи экранируем один раз на набор строк, а не на каждую строку
+        {
+            m_keys.resize(nFields);
+            m_kinds.resize(nFields);
+            for (int field = 0; field < nFields; ++field)
+            {
+                const char* const name = ::PQfname(res, field);
+                m_keys[field] = escapeKey(name);
+                m_kinds[field] = kindOf(::PQftype(res, field), ::PQfformat(res, field));
+            }
+        }
+
+        for (int row = 0; row < nTuples; ++row)
+        {
+            out.append('{');
+            for (int field = 0; field < nFields; ++field)
+            {
+                if (0 != field)
+                    out.append(',');
+                out.append(m_keys[field].data(), m_keys[field].size());
+
+                if (::PQgetisnull(res, row, field))
+                {
+                    out.append("null", 4);
+                    continue;
+                }
+
+                appendValue(out, m_kinds[field], ::PQgetvalue(res, row, field), std::size_t(::PQgetlength(res, row, field)));
+            }
+            out.append("}\n", 2);
+        }
+    }
+
+private:
+    enum class Kind
+    {
+        STRING,
+        NUMBER,
+        BOOL,
+        JSON,
+        BINARY
+    };
+
+    static Kind kindOf(Oid type, int format) noexcept
+    {
+        if (1 == format)
+            return Kind::BINARY;
+
+        switch (type)
+        {
+        case detail::INT2_OID:
+        case detail::INT4_OID:
+        case detail::INT8_OID:
+        case detail::OID_OID:
+        case detail::FLOAT4_OID:
+        case detail::FLOAT8_OID:
+        case detail::NUMERIC_OID:
+            return Kind::NUMBER;
+        case detail::BOOL_OID:
+            return Kind::BOOL;
+        case detail::JSON_OID:
+        case detail::JSONB_OID:
+            return Kind::JSON;
+        default:
+            return Kind::STRING;
+        }
+    }
+
+    static std::string escapeKey(const char* name)
+    {
+        detail::OutputBuffer buffer;
+        detail::appendJsonString(buffer, name, std::strlen(name));
+
+        struct Collect
+        {
+            boost::system::error_code write(const std::vector<boost::asio::const_buffer>& buffers)
+            {
+                for (const auto& b : buffers)
+                    key.append(boost::asio::buffer_cast<const char*>(b), boost::asio::buffer_size(b));
+                return {};
+            }
+
+            std::string key;
+        } collect;
+
+        buffer.flush(collect);
+        collect.key += ':';
+        return std::move(collect.key);
+    }
+
+    static void appendValue(detail::OutputBuffer& out, Kind kind, const char* value, std::size_t length)
+    {
+        switch (kind)
+        {
+        case Kind::NUMBER:
+            // NaN, Infinity и -Infinity в JSON числами не бывают
+            if (0 != length && ('N' == value[length - 1] || 'y' == value[length - 1]))
+                return detail::appendJsonString(out, value, length);
+            return out.append(value, length);
+        case Kind::BOOL:
+            return 't' == *value ? out.append("true", 4) : out.append("false", 5);
+        case Kind::JSON:
+            return out.append(value, length);
+        case Kind::BINARY:
+        {
+            out.append('"');
+            detail::appendHex(out, value, length);
+            return out.append('"');
+        }
+        default:
+            return detail::appendJsonString(out, value, length);
+        }
+    }
+
+private:
+    std::vector<std::string> m_keys; // "имя": для каждой колонки
+    std::vector<Kind> m_kinds;
+};
+
+template <typename Sink>
+CsvWriter<Sink> makeCsvWriter(Sink sink, const CsvOptions& options = {})
+{
+    return CsvWriter<Sink>{ std::move(sink), options };
+}
+
+template <typename Sink>
+JsonLinesWriter<Sink> makeJsonLinesWriter(Sink sink, const JsonLinesOptions& options = {})
+{
+    return JsonLinesWriter<Sink>{ std::move(sink), options };
+}
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#include <boost/asio/strand.hpp>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/ignore_result.hpp"
+#include "../layer1/result.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer3/cloned_params.hpp"
+#include "connection_pool.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct AutoPipelineOptions
+{
+    // сколько конвейеров держать в работе одновременно, обычно размер пула:
+    // пока их меньше, команды уходят сразу, не дожидаясь соседей
+    std::size_t pipelines = 1;
+    // команд в одном конвейере, остальные ждут следующего
+    std::size_t depth = 64;
+};
+
+namespace detail {
+
+struct PipelinedStatement
+{
+    std::string query;
+    ClonedParams params;
+    bool textResultFormat;
+    std::function<boost::system::error_code(Result&&)> collector;
+    std::function<void(const boost::system::error_code&)> handler;
+    boost::system::error_code ec;
+    bool done = false; // получены все результаты команды
+};
+
+// Команды одного прохода до сервера. В конвейере у каждой команды своя точка синхронизации,
+// поэтому ошибка одной не прерывает остальные: команды независимы, как если бы шли по одной.
+class PipelineBatch
+{
+public:
+    explicit PipelineBatch(std::vector<PipelinedStatement>&& statements)
+        : m_statements{ std::move(statements) }
+    {
+    }
+
+    template <typename Handler>
+    void send(Connection& conn, Handler&& handler)
+    {
+        // пул с переподключением повторяет операцию на новом соединении с начала
+        m_current = 0;
+        for (auto& statement : m_statements)
+        {
+            statement.ec = boost::system::error_code{};
+            statement.done = false;
+        }
+
+#ifdef LIBPQ_HAS_PIPELINING
+        conn.asyncExecPipeline(
+              [this, pgConn{ conn.get() }]{
+                if (!::PQenterPipelineMode(pgConn))
+                    return make_error_code(PQError::PIPELINE_FAILED);
+
+                for (const auto& statement : m_statements)
+                {
+                    if (!sendStatement(pgConn, statement))
+                        return make_error_code(PQError::SEND_QUERY_PARAMS_FAILED);
+
+                    if (!::PQpipelineSync(pgConn))
+                        return make_error_code(PQError::PIPELINE_FAILED);
+                }
+
+                return boost::system::error_code{};
+              }
+            , int(m_statements.size())
+            , std::forward<Handler>(handler)
+            , Dispatch{ this }
+            );
+#else
+        assert(1 == m_statements.size());
+        conn.asyncExec(
+              [this, pgConn{ conn.get() }]{
+                if (!sendStatement(pgConn, m_statements.front()))
+                    return make_error_code(PQError::SEND_QUERY_PARAMS_FAILED);
+
+                return boost::system::error_code{};
+              }
+            , std::forward<Handler>(handler)
+            , Dispatch{ this }
+            );
+#endif
+    }
+
+    std::vector<PipelinedStatement>& statements() noexcept
+    {
+        return m_statements;
+    }
+
+private:
+    static bool sendStatement(::PGconn* pgConn, const PipelinedStatement& statement)
+    {
+        return ::PQsendQueryParams(
+              pgConn
+            , statement.query.c_str()
+            , statement.params.n()
+            , statement.params.types()
+            , statement.params.values()
+            , statement.params.lengths()
+            , statement.params.formats()
+            , statement.textResultFormat ? 0 : 1
+            );
+    }
+
+    // раздает результаты коллекторам команд по порядку, nullptr завершает очередную команду
+    struct Dispatch
+    {
+        using TakesOwnership = std::true_type;
+
+        boost::system::error_code operator()(Result res) const
+        {
+            if (batch->m_current >= batch->m_statements.size())
+                return IgnoreResult{}(res.get());
+
+            auto& statement = batch->m_statements[batch->m_current];
+            const bool last = !res;
+            const auto ec = statement.collector(std::move(res));
+            if (ec)
+                statement.ec = ec;
+
+            if (last)
+            {
+                statement.done = true;
+                ++batch->m_current;
+            }
+
+            return ec;
+        }
+
+        PipelineBatch* batch;
+    };
+
+private:
+    std::vector<PipelinedStatement> m_statements;
+    std::size_t m_current = 0; // команда, чьи результаты сейчас приходят
+};
+
+} // namespace detail
+
+// Автоматический конвейер над пулом для простых независимых команд с параметрами.
+// Пока в работе меньше options.pipelines конвейеров, команда уходит сразу; когда все соединения заняты,
+// команды копятся и следующее освободившееся соединение отправляет до depth из них одним конвейером libpq,
+// так что за время одного прохода до сервера выполняется много команд без новых соединений.
+// Хендлеры команд одного конвейера вызываются друг за другом в порядке отправки, ошибка команды не задевает соседей.
+// Без поддержки конвейера в libpq команды отправляются по одной.
+// Требования к Pool - см. PolymorphicOperationType. BEGIN/COMMIT и SET через AutoPipeline
+// отправлять нельзя: соседние команды выполняются на случайных соединениях.
+// Объект должен жить, пока не завершатся все отправленные команды.
+template <typename Pool>
+class AutoPipeline
+{
+public:
+    AutoPipeline(const AutoPipeline&) = delete;
+    AutoPipeline& operator=(const AutoPipeline&) = delete;
+
+    AutoPipeline(boost::asio::io_service& ios, Pool& pool, const AutoPipelineOptions& options = {})
+        : m_pool{ pool }
+        , m_strand{ ios }
+        , m_options{ options }
+    {
+        if (0 == m_options.pipelines || 0 == m_options.depth)
+            throw std::invalid_argument("AutoPipeline pipelines and depth can't be zero");
+
+#ifndef LIBPQ_HAS_PIPELINING
+        m_options.depth = 1;
+#endif
+    }
+
+    // потокобезопасен, синхронизирован через strand; query и params копируются
+    template <typename Params, typename Handler, typename ResultCollector = IgnoreResult>
+    auto asyncQueryParams(std::string query, const Params& params, bool textResultFormat, Handler&& handler, ResultCollector&& coll = {})
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        detail::PipelinedStatement statement{
+              std::move(query)
+            , ClonedParams{ params }
+            , textResultFormat
+            , [coll{ std::forward<ResultCollector>(coll) }](Result&& res) mutable {
+                  return detail::collectResult(coll, std::move(res));
+              }
+            , std::move(init.handler)
+            };
+
+        // ClonedParams ссылается на свои строки, копия указывала бы на чужие, поэтому только перемещение
+        m_strand.dispatch([this, statement{ detail::MoveOnCopy<detail::PipelinedStatement>{ std::move(statement) } }]() mutable {
+            m_queue.push_back(std::move(statement.value));
+            if (m_running < m_options.pipelines)
+                submit();
+        });
+
+        return init.result.get();
+    }
+
+private:
+    void submit()
+    {
+        const std::size_t count = std::min(m_queue.size(), m_options.depth);
+        std::vector<detail::PipelinedStatement> statements{
+              std::make_move_iterator(m_queue.begin())
+            , std::make_move_iterator(m_queue.begin() + std::ptrdiff_t(count))
+            };
+        m_queue.erase(m_queue.begin(), m_queue.begin() + std::ptrdiff_t(count));
+        ++m_running;
+
+        auto batch = std::make_shared<detail::PipelineBatch>(std::move(statements));
+        m_pool(
+              [batch](Connection& conn, auto&& handler) {
+                  batch->send(conn, std::forward<decltype(handler)>(handler));
+              }
+            , [this, batch](const boost::system::error_code& ec, const Connection*) {
+                  complete(batch, ec);
+              }
+            );
+    }
+
+    void complete(const std::shared_ptr<detail::PipelineBatch>& batch, const boost::system::error_code& ec)
+    {
+        // до команды дело не дошло: конвейер оборвался раньше
+        for (auto& statement : batch->statements())
+        {
+            if (!statement.done)
+                statement.ec = ec ? ec : make_error_code(PQError::PIPELINE_FAILED);
+        }
+
+        // хендлеры вызывающих исполняются вне strand пула одной задачей, чтобы идти строго в порядке отправки команд
+        m_strand.get_io_service().post([batch] {
+            for (auto& statement : batch->statements())
+                detail::invokeHandler(std::move(statement.handler), statement.ec);
+        });
+
+        m_strand.dispatch([this] {
+            --m_running;
+            if (!m_queue.empty())
+                submit();
+        });
+    }
+
+private:
+    Pool& m_pool;
+    boost::asio::io_service::strand m_strand;
+    AutoPipelineOptions m_options;
+    std::deque<detail::PipelinedStatement> m_queue;
+    std::size_t m_running = 0; // конвейеров в работе
+};
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,514 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/optional.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/deadline_timer.hpp>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer2/async_query_params.hpp"
+
+namespace ba {
+namespace asiopq {
+
+enum class BatchMode
+{
+    MULTI_VALUES, // INSERT ... VALUES ($1, $2), ($3, $4), ...
+    UNNEST, // INSERT ... SELECT * FROM unnest($1::type[], $2::type[]), нужны типы колонок
+    COPY // COPY ... FROM STDIN в текстовом формате
+};
+
+struct BatchWriterOptions
+{
+    std::string table; // подставляются в SQL как есть, экранирование на вызывающей стороне
+    std::vector<std::string> columns;
+    std::vector<std::string> types; // SQL-типы колонок, обязательны для UNNEST, для MULTI_VALUES добавляют приведения
+    BatchMode mode = BatchMode::MULTI_VALUES;
+    std::size_t maxRows = 1'000;
+    boost::posix_time::time_duration window = boost::posix_time::milliseconds{ 2 };
+};
+
+namespace detail {
+
+using BatchRow = std::vector<boost::optional<std::string>>;
+
+inline void appendArrayElement(std::string& out, const boost::optional<std::string>& value)
+{
+    if (!value)
+    {
+        out += "NULL";
+        return;
+    }
+
+    out += '"';
+    for (const char c : *value)
+    {
+        if ('"' == c || '\\' == c)
+            out += '\\';
+        out += c;
+    }
+    out += '"';
+}
+
+inline void appendCopyField(std::string& out, const boost::optional<std::string>& value)
+{
+    if (!value)
+    {
+        out += "\\N";
+        return;
+    }
+
+    for (const char c : *value)
+    {
+        switch (c)
+        {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+// Отмечает, что сервер перешел в COPY FROM STDIN и ждет данных
+class CopyInStarted
+{
+public:
+    explicit CopyInStarted(bool& started)
+        : m_started{ &started }
+    {
+    }
+
+    boost::system::error_code operator()(const ::PGresult* res) const noexcept
+    {
+        if (res && PGRES_COPY_IN == ::PQresultStatus(res))
+            *m_started = true;
+
+        return IgnoreResult{}(res);
+    }
+
+private:
+    bool* m_started;
+};
+
+// Отдает данные COPY FROM STDIN, не блокируя поток io_service: на время передачи соединение неблокирующее,
+// данные уходят кусками, пока libpq не может их принять, ждем готовности сокета к записи.
+// Затем PQputCopyEnd и досылка буфера libpq тем же циклом. Хендлер: void(const boost::system::error_code&)
+template <typename Handler>
+class CopyInWriter
+{
+    static constexpr std::size_t CHUNK = 64 * 1024;
+
+public:
+    CopyInWriter(Connection& conn, const std::string& data, Handler&& handler)
+        : m_conn{ &conn }
+        , m_data{ &data }
+        , m_handler{ std::move(handler) }
+    {
+    }
+
+    void start()
+    {
+        if (0 != ::PQsetnonblocking(m_conn->get(), 1))
+            return invokeHandler(std::move(m_handler), make_error_code(PQError::SEND_QUERY_FAILED));
+
+        (*this)(boost::system::error_code{});
+    }
+
+    void operator()(const boost::system::error_code& ec)
+    {
+        if (ec)
+            return complete(ec);
+
+        ::PGconn* const pgConn = m_conn->get();
+        while (m_offset < m_data->size())
+        {
+            const std::size_t chunk = std::min(m_data->size() - m_offset, std::size_t{ CHUNK });
+            const int sent = ::PQputCopyData(pgConn, m_data->data() + m_offset, int(chunk));
+            if (sent < 0)
+                return complete(make_error_code(PQError::SEND_QUERY_FAILED));
+
+            if (0 == sent) // буфер libpq полон
+                return m_conn->asyncWaitWriting(std::move(*this));
+
+            m_offset += chunk;
+        }
+
+        if (!m_ended)
+        {
+            const int ended = ::PQputCopyEnd(pgConn, nullptr);
+            if (ended < 0)
+                return complete(make_error_code(PQError::SEND_QUERY_FAILED));
+
+            if (0 == ended)
+                return m_conn->asyncWaitWriting(std::move(*this));
+
+            m_ended = true;
+        }
+
+        switch (::PQflush(pgConn))
+        {
+        case 0:
+            return complete(boost::system::error_code{});
+        case 1:
+            return m_conn->asyncWaitWriting(std::move(*this));
+        default:
+            return complete(make_error_code(PQError::SEND_QUERY_FAILED));
+        }
+    }
+
+private:
+    void complete(const boost::system::error_code& ec)
+    {
+        // остальной код рассчитывает на блокирующее соединение: PQsend* отправляет команду целиком
+        if (!ec && 0 != ::PQsetnonblocking(m_conn->get(), 0))
+            return invokeHandler(std::move(m_handler), make_error_code(PQError::SEND_QUERY_FAILED));
+
+        invokeHandler(std::move(m_handler), ec);
+    }
+
+private:
+    Connection* m_conn;
+    const std::string* m_data;
+    Handler m_handler;
+    std::size_t m_offset = 0;
+    bool m_ended = false;
+};
+
+template <typename Handler>
+void asyncPutCopyData(Connection& conn, const std::string& data, Handler&& handler)
+{
+    CopyInWriter<std::decay_t<Handler>>{ conn, data, std::forward<Handler>(handler) }.start();
+}
+
+// Одна отправка: собранная команда, ее параметры и хендлеры вызывающих
+class Batch
+{
+public:
+    Batch(const BatchWriterOptions& options, std::vector<BatchRow>&& rows, std::vector<std::function<void(const boost::system::error_code&)>>&& handlers)
+        : m_mode{ options.mode }
+        , m_rows{ std::move(rows) }
+        , m_handlers{ std::move(handlers) }
+    {
+        std::string columns;
+        for (const auto& column : options.columns)
+        {
+            if (!columns.empty())
+                columns += ", ";
+            columns += column;
+        }
+
+        switch (m_mode)
+        {
+        case BatchMode::MULTI_VALUES:
+            buildMultiValues(options, columns);
+            break;
+        case BatchMode::UNNEST:
+            buildUnnest(options, columns);
+            break;
+        case BatchMode::COPY:
+            buildCopy(options, columns);
+            break;
+        }
+    }
+
+    template <typename Handler>
+    void send(Connection& conn, Handler&& handler)
+    {
+        if (BatchMode::COPY != m_mode)
+            return asyncQueryParams(conn, m_command.c_str(), *this, true, std::forward<Handler>(handler));
+
+        // COPY в три этапа: команда до PGRES_COPY_IN, передача данных, чтение итога команды
+        m_copyStarted = false;
+        conn.asyncExec(
+              [pgConn{ conn.get() }, command{ m_command.c_str() }]{
+                if (!::PQsendQuery(pgConn, command))
+                    return make_error_code(PQError::SEND_QUERY_FAILED);
+
+                return boost::system::error_code{};
+              }
+            , [this, &conn, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+                  if (ec || !m_copyStarted)
+                      return invokeHandler(std::move(handler), ec);
+
+                  asyncPutCopyData(conn, m_copyData, [&conn, handler{ std::move(handler) }](const boost::system::error_code& ec) mutable {
+                      if (ec)
+                      {
+                          conn.close(); // соединение осталось посреди COPY, пул с переподключением заменит его
+                          return invokeHandler(std::move(handler), ec);
+                      }
+
+                      conn.asyncExec([] { return boost::system::error_code{}; }, std::move(handler));
+                  });
+              }
+            , CopyInStarted{ m_copyStarted }
+            );
+    }
+
+    std::vector<BatchRow>& rows() noexcept
+    {
+        return m_rows;
+    }
+
+    std::vector<std::function<void(const boost::system::error_code&)>>& handlers() noexcept
+    {
+        return m_handlers;
+    }
+
+    // интерфейс Params для asyncQueryParams
+    int n() const noexcept
+    {
+        return int(m_valuesView.size());
+    }
+
+    const Oid* types() const noexcept
+    {
+        return nullptr;
+    }
+
+    const char* const* values() const noexcept
+    {
+        return m_valuesView.data();
+    }
+
+    const int* lengths() const noexcept
+    {
+        return nullptr;
+    }
+
+    const int* formats() const noexcept
+    {
+        return nullptr;
+    }
+
+private:
+    void buildMultiValues(const BatchWriterOptions& options, const std::string& columns)
+    {
+        m_command = "INSERT INTO " + options.table + " (" + columns + ") VALUES ";
+
+        std::size_t param = 0;
+        for (const auto& row : m_rows)
+        {
+            m_command += 0 == param ? "(" : ", (";
+            for (std::size_t i = 0; i != row.size(); ++i)
+            {
+                if (0 != i)
+                    m_command += ", ";
+
+                m_command += '$';
+                m_command += std::to_string(++param);
+                if (i < options.types.size())
+                    m_command += "::" + options.types[i];
+
+                m_valuesView.push_back(row[i] ? row[i]->c_str() : nullptr);
+            }
+            m_command += ')';
+        }
+    }
+
+    void buildUnnest(const BatchWriterOptions& options, const std::string& columns)
+    {
+        assert(options.types.size() == options.columns.size());
+
+        m_command = "INSERT INTO " + options.table + " (" + columns + ") SELECT * FROM unnest(";
+        m_arrays.resize(options.columns.size());
+
+        for (std::size_t i = 0; i != m_arrays.size(); ++i)
+        {
+            auto& array = m_arrays[i];
+            array = "{";
+            for (const auto& row : m_rows)
+            {
+                if (array.size() > 1)
+                    array += ',';
+                appendArrayElement(array, row[i]);
+            }
+            array += '}';
+
+            if (0 != i)
+                m_command += ", ";
+            m_command += '$' + std::to_string(i + 1) + "::" + options.types[i] + "[]";
+        }
+        m_command += ')';
+
+        for (const auto& array : m_arrays)
+            m_valuesView.push_back(array.c_str());
+    }
+
+    void buildCopy(const BatchWriterOptions& options, const std::string& columns)
+    {
+        m_command = "COPY " + options.table + " (" + columns + ") FROM STDIN";
+
+        for (const auto& row : m_rows)
+        {
+            for (std::size_t i = 0; i != row.size(); ++i)
+            {
+                if (0 != i)
+                    m_copyData += '\t';
+                appendCopyField(m_copyData, row[i]);
+            }
+            m_copyData += '\n';
+        }
+    }
+
+private:
+    const BatchMode m_mode;
+    std::vector<BatchRow> m_rows;
+    std::vector<std::function<void(const boost::system::error_code&)>> m_handlers;
+    std::string m_command;
+    std::vector<std::string> m_arrays;
+    std::string m_copyData;
+    bool m_copyStarted = false;
+    std::vector<const char*> m_valuesView;
+};
+
+} // namespace detail
+
+// Копит однострочные записи от множества вызывающих и отправляет их через пул одной командой:
+// по достижении maxRows или через window после первой строки пачки.
+// Если сервер отверг команду пачки, ее строки переотправляются по одной, и каждый хендлер получает свой результат;
+// при остальных ошибках (обрыв, отмена, срок, открытый предохранитель) все хендлеры пачки получают эту ошибку.
+// Pool - как для asyncBeginTransaction (см. PolymorphicOperationType).
+// Объект должен жить, пока не завершатся все отправленные записи.
+template <typename Pool>
+class BatchWriter
+{
+public:
+    BatchWriter(const BatchWriter&) = delete;
+    BatchWriter& operator=(const BatchWriter&) = delete;
+
+    BatchWriter(boost::asio::io_service& ios, Pool& pool, BatchWriterOptions options)
+        : m_pool{ pool }
+        , m_strand{ ios }
+        , m_timer{ ios }
+        , m_options{ std::move(options) }
+    {
+        if (m_options.columns.empty())
+            throw std::invalid_argument("BatchWriter columns can't be empty");
+
+        // в одной команде не больше 65535 параметров
+        if (BatchMode::MULTI_VALUES == m_options.mode)
+            m_options.maxRows = std::min(m_options.maxRows, std::size_t(65'535) / m_options.columns.size());
+
+        if (0 == m_options.maxRows)
+            throw std::invalid_argument("BatchWriter maxRows can't be zero");
+    }
+
+    // потокобезопасен, синхронизирован через strand;
+    // params - текстовые значения одной строки в порядке columns
+    template <typename Params, typename Handler>
+    auto operator()(const Params& params, Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        assert(std::size_t(params.n()) == m_options.columns.size());
+        assert(!params.formats() || std::all_of(params.formats(), params.formats() + params.n(), [](int f) { return 0 == f; }));
+
+        detail::BatchRow row;
+        row.reserve(std::size_t(params.n()));
+        for (int i = 0; i < params.n(); ++i)
+        {
+            const char* const value = params.values()[i];
+            row.push_back(value ? boost::optional<std::string>{ value } : boost::none);
+        }
+
+        m_strand.dispatch([this, row{ std::move(row) }, handler{ std::move(init.handler) }]() mutable {
+            m_rows.push_back(std::move(row));
+            m_handlers.emplace_back(std::move(handler));
+
+            if (m_rows.size() >= m_options.maxRows)
+                return flush();
+
+            if (1 == m_rows.size())
+            {
+                m_timer.expires_from_now(m_options.window);
+                m_timer.async_wait(m_strand.wrap([this, generation{ m_generation }](const boost::system::error_code& ec) {
+                    if (!ec && generation == m_generation)
+                        flush();
+                }));
+            }
+        });
+
+        return init.result.get();
+    }
+
+private:
+    void flush()
+    {
+        ++m_generation; // таймер этой пачки больше не актуален
+        boost::system::error_code ignoreEc;
+        m_timer.cancel(ignoreEc);
+
+        submit(std::make_shared<detail::Batch>(m_options, std::move(m_rows), std::move(m_handlers)));
+        m_rows.clear();
+        m_handlers.clear();
+    }
+
+    void submit(std::shared_ptr<detail::Batch> batch)
+    {
+        m_pool(
+              [batch](Connection& conn, auto&& handler) {
+                  batch->send(conn, std::forward<decltype(handler)>(handler));
+              }
+            , [this, batch](const boost::system::error_code& ec, const Connection* conn) {
+                  complete(batch, ec, conn);
+              }
+            );
+    }
+
+    void complete(const std::shared_ptr<detail::Batch>& batch, const boost::system::error_code& ec, const Connection* conn)
+    {
+        auto& handlers = batch->handlers();
+        // Делим только ошибку команды на живом соединении. После обрыва пачка могла быть записана, хотя ответ
+        // потерян: повтор строк записал бы их дважды, а тысяча одиночных операций лишь нагрузила бы сбоящий пул
+        if (ec && handlers.size() > 1 && ec.category() == sqlstatecategory()
+            && conn && ::CONNECTION_OK == ::PQstatus(conn->get()))
+        {
+            // сервер отверг атомарную команду, ни одна строка не записана, выясняем, какие строки виноваты
+            auto& rows = batch->rows();
+            for (std::size_t i = 0; i != rows.size(); ++i)
+            {
+                std::vector<detail::BatchRow> single(1, std::move(rows[i]));
+                std::vector<std::function<void(const boost::system::error_code&)>> singleHandler(1, std::move(handlers[i]));
+                submit(std::make_shared<detail::Batch>(m_options, std::move(single), std::move(singleHandler)));
+            }
+            return;
+        }
+
+        // хендлеры вызывающих исполняются вне strand пула
+        for (auto& handler : handlers)
+            m_strand.get_io_service().post([handler{ std::move(handler) }, ec]() mutable {
+                detail::invokeHandler(std::move(handler), ec);
+            });
+    }
+
+private:
+    Pool& m_pool;
+    boost::asio::io_service::strand m_strand;
+    boost::asio::deadline_timer m_timer;
+    BatchWriterOptions m_options;
+    std::vector<detail::BatchRow> m_rows;
+    std::vector<std::function<void(const boost::system::error_code&)>> m_handlers;
+    unsigned m_generation = 0;
+};
+
+} // namespace asiopq
+} // namespace ba
@@ -1,17 +1,110 @@
 #pragma once
 
 #include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer1/flight_recorder.hpp"
 
+#include <map>
 #include <list>
-#include <queue>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
 
 #include <boost/asio/strand.hpp>
+#include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/version.hpp>
+#include <boost/optional.hpp>
 
+#if defined(BA_ASIOPQ_FLIGHT_RECORDER) != BA_ASIOPQ_FLIGHT_RECORDER_ENABLED
+#error "BA_ASIOPQ_FLIGHT_RECORDER must be set before the first asiopq header and the same way for the whole program"
+#endif
 
 namespace ba {
 namespace asiopq {
 
+// необязательные параметры одного запроса к пулу
+struct RequestOptions
+{
+    // отмена ожидающего в очереди запроса убирает его из очереди,
+    // выполняющегося - отправляет серверу запрос отмены, соединение возвращается в пул;
+    // хендлер получает boost::asio::error::operation_aborted
+    CancellationSlot cancellation;
+    // Если запрос не получил соединение до этого момента, он завершается с boost::asio::error::timed_out,
+    // не занимая соединения. Очередь упорядочена по сроку (EDF), запросы без срока идут после всех со сроком
+    // и между собой в порядке поступления. На уже выполняющийся запрос срок не влияет.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // индекс полосы из ConnectionPoolOptions::lanes, 0 - высший приоритет
+    std::size_t priority = 0;
+    // Имя подготовленной команды, которую выполняет операция. Из свободных соединений пул выберет то,
+    // где она уже выполнялась успешно (а значит, подготовлена), иначе любое: ожидания ради этого не бывает.
+    // Пусто - без предпочтений.
+    std::string statement;
+};
+
+// Полоса приоритета пула: у каждой своя очередь с порядком по срокам.
+// Резерв полосы - соединения, которые пул держит для нее и более приоритетных полос,
+// поэтому всплеск фоновых запросов не может занять весь пул.
+struct PoolLane
+{
+    // столько соединений никогда не достанутся полосам с меньшим приоритетом
+    std::size_t reserved = 0;
+    // доля выборки при взвешенной очередности
+    unsigned weight = 1;
+};
+
+struct ConnectionPoolOptions
+{
+    std::vector<PoolLane> lanes{ PoolLane{} };
+    // false - освободившееся соединение получает самая приоритетная непустая полоса,
+    // true - полосы выбираются по весам (плавный взвешенный round-robin), чтобы низкие не голодали
+    bool weighted = false;
+};
+
+namespace detail {
+
+// asio до executors требует от хендлеров post/dispatch CopyConstructible, хотя сама их только перемещает.
+// Обертка позволяет передать через strand.dispatch операцию с некопируемыми захватами: "копия" забирает значение.
+template <typename T>
+struct MoveOnCopy
+{
+    explicit MoveOnCopy(T&& value)
+        : value{ std::move(value) }
+    {
+    }
+
+    MoveOnCopy(MoveOnCopy&&) = default;
+
+    MoveOnCopy(const MoveOnCopy& other)
+        : value{ std::move(const_cast<MoveOnCopy&>(other).value) }
+    {
+    }
+
+    T value;
+};
+
+template <typename T>
+using DispatchCapture = std::conditional_t<std::is_copy_constructible<T>::value, T, MoveOnCopy<T>>;
+
+template <typename T>
+T&& dispatchCaptured(T& value) noexcept
+{
+    return std::move(value);
+}
+
+template <typename T>
+T&& dispatchCaptured(MoveOnCopy<T>& captured) noexcept
+{
+    return std::move(captured.value);
+}
+
+} // namespace detail
+
 template <typename Operation, typename CompletionHandler>
 class ConnectionPool
 {
@@ -21,55 +114,336 @@ public:
     ConnectionPool(ConnectionPool&&) = delete;
     ConnectionPool& operator=(ConnectionPool&&) = delete;
 
-    ConnectionPool(boost::asio::io_service& ios, std::size_t size)
+    ConnectionPool(boost::asio::io_service& ios, std::size_t size, const ConnectionPoolOptions& options = {})
         : m_strand{ ios }
+        , m_deadlineTimer{ ios }
+        , m_weighted{ options.weighted }
     {
         if (0 == size)
             throw std::invalid_argument("ConnectionPool size can't be zero");
 
+        if (options.lanes.empty())
+            throw std::invalid_argument("ConnectionPool lanes can't be empty");
+
+        std::size_t reserved = 0;
+        for (const auto& lane : options.lanes)
+        {
+            if (m_weighted && 0 == lane.weight)
+                throw std::invalid_argument("ConnectionPool lane weight can't be zero");
+
+            reserved += lane.reserved;
+            m_lanes.emplace_back(lane);
+        }
+
+        if (reserved > size)
+            throw std::invalid_argument("ConnectionPool reserved connections exceed its size");
+
         while (size--)
             m_ready.emplace_back(ios);
+
+        // места под выполняющиеся операции заводим заранее, запросы не меняют таблицу
+        for (const auto& conn : m_ready)
+        {
+            m_running[&conn];
+            m_affinity[&conn];
+        }
     }
 
     // потокобезопасен, синхронизирован через strand
     template <typename OtherOp, typename OtherHandler>
-    auto operator()(OtherOp&& op, OtherHandler&& handler)
+    auto operator()(OtherOp&& op, OtherHandler&& handler, RequestOptions options = {})
     {
         detail::async_result_init<OtherHandler, void(boost::system::error_code, const Connection*)>
             init{ std::forward<OtherHandler>(handler) };
 
-        m_strand.dispatch([this, op{ std::forward<OtherOp>(op) }, trueHandler{ std::move(init.handler) }]() mutable {
-            if (m_ready.empty())
+        m_strand.dispatch([
+              this
+            , op{ detail::DispatchCapture<std::decay_t<OtherOp>>{ std::forward<OtherOp>(op) } }
+            , trueHandler{ std::move(init.handler) }
+            , options{ std::move(options) }
+            , enqueued{ detail::FlightStamp{} }
+            ]() mutable {
+            // состояние заводим только для отменяемых запросов, остальные не платят за отмену
+            std::shared_ptr<RequestState> request;
+            if (options.cancellation.connected())
             {
-                m_opQueue.emplace(std::move(op), std::move(trueHandler));
+                if (options.cancellation.cancelled()) // отменили раньше, чем запрос дошел до пула
+                    return abort(std::move(trueHandler), boost::asio::error::operation_aborted);
+
+                request = std::make_shared<RequestState>(std::move(options.cancellation));
+            }
+
+            if (options.deadline <= std::chrono::steady_clock::now())
+                return abort(std::move(trueHandler), boost::asio::error::timed_out);
+
+            assert(options.priority < m_lanes.size());
+            const std::size_t lane = options.priority;
+
+            if (m_ready.empty() || !admissible(lane, m_ready.size()))
+            {
+                auto& queue = m_lanes[lane].queue;
+                const auto position = queue.emplace(options.deadline, Pending{ detail::dispatchCaptured(op), std::move(trueHandler), request, enqueued, std::move(options.statement) });
+                if (request)
+                {
+                    request->queued = true;
+                    request->lane = lane;
+                    request->position = position;
+                    watchCancellation(request);
+                }
+
+                if (position == queue.begin() && options.deadline != std::chrono::steady_clock::time_point::max())
+                    armDeadlineTimer(); // возможно, новый самый ранний срок
                 return;
             }
 
-            auto conn = m_ready.begin();
+            auto conn = pickReady(options.statement);
             setBusy(conn);
-
-            m_strand.get_io_service().post([op{ std::move(op) }, this, conn, trueHandler{ std::move(trueHandler) }]() mutable {
-                op(
-                      *conn
-                    , m_strand.wrap([this, conn, trueHandler{ std::move(trueHandler) }](const boost::system::error_code& ec) mutable {
-                          handleExec(conn, std::move(trueHandler), ec);
-                      })
-                    );
-            });
+            start(conn, lane, detail::dispatchCaptured(op), std::move(trueHandler), std::move(request), enqueued, std::move(options.statement));
         });
 
         return init.result.get();
     }
 
+    boost::asio::io_service& get_io_service()
+    {
+        return m_strand.get_io_service();
+    }
+
 private:
+    struct Pending;
+    using Queue = std::multimap<std::chrono::steady_clock::time_point, Pending>;
+
+    struct RequestState
+    {
+        explicit RequestState(CancellationSlot slot)
+            : slot{ std::move(slot) }
+        {
+        }
+
+        CancellationSlot slot;
+        bool queued = false;
+        bool cancelled = false;
+        std::size_t lane = 0;
+        typename Queue::iterator position;
+        const Connection* conn = nullptr; // пока запрос выполняется
+    };
+
+    // может ли полоса занять одно из free свободных соединений, не задев резерв более приоритетных полос
+    bool admissible(std::size_t lane, std::size_t free) const noexcept
+    {
+        std::size_t reservedAbove = 0;
+        for (std::size_t i = 0; i != lane; ++i)
+            if (m_lanes[i].reserved > m_lanes[i].busy)
+                reservedAbove += m_lanes[i].reserved - m_lanes[i].busy;
+
+        return free > reservedAbove;
+    }
+
+    bool hasAdmissible(std::size_t free) const noexcept
+    {
+        for (std::size_t i = 0; i != m_lanes.size(); ++i)
+            if (!m_lanes[i].queue.empty() && admissible(i, free))
+                return true;
+
+        return false;
+    }
+
+    // полоса, которая получит освободившееся соединение, или m_lanes.size(), если никакая
+    std::size_t pickLane(std::size_t free)
+    {
+        if (!m_weighted)
+        {
+            for (std::size_t i = 0; i != m_lanes.size(); ++i)
+                if (!m_lanes[i].queue.empty() && admissible(i, free))
+                    return i;
+
+            return m_lanes.size();
+        }
+
+        // плавный взвешенный round-robin, как в nginx
+        std::size_t best = m_lanes.size();
+        long total = 0;
+        for (std::size_t i = 0; i != m_lanes.size(); ++i)
+        {
+            auto& lane = m_lanes[i];
+            if (lane.queue.empty() || !admissible(i, free))
+                continue;
+
+            lane.current += lane.weight;
+            total += lane.weight;
+            if (best == m_lanes.size() || lane.current > m_lanes[best].current)
+                best = i;
+        }
+
+        if (best != m_lanes.size())
+            m_lanes[best].current -= total;
+
+        return best;
+    }
+
+    void watchCancellation(const std::shared_ptr<RequestState>& request)
+    {
+        request->slot.assign([this, weak{ std::weak_ptr<RequestState>{ request } }]() {
+            m_strand.dispatch([this, weak]() {
+                if (const auto request = weak.lock())
+                    cancel(request);
+            });
+        });
+    }
+
+    void cancel(const std::shared_ptr<RequestState>& request)
+    {
+        request->cancelled = true;
+
+        if (!request->queued)
+        {
+            // ключ берется сейчас: операция с переподключением могла уже сменить серверный процесс
+            if (request->conn)
+                if (auto cancel = request->conn->cancelHandle())
+                    detail::sendCancelRequest(std::move(cancel));
+            return;
+        }
+
+        // O(1): запрос знает свое место в очереди
+        auto pending = std::move(request->position->second);
+        m_lanes[request->lane].queue.erase(request->position);
+        request->queued = false;
+        if (queuesEmpty())
+            cancelDeadlineTimer();
+
+        abort(std::move(pending.handler), boost::asio::error::operation_aborted);
+    }
+
+    // завершение запроса, который так и не получил соединение
+    template <typename Handler>
+    void abort(Handler&& handler, boost::asio::error::basic_errors e)
+    {
+        m_strand.get_io_service().post([handler{ std::forward<Handler>(handler) }, e]() mutable {
+            detail::invokeHandler(std::move(handler), make_error_code(e), static_cast<const Connection*>(nullptr));
+        });
+    }
+
+    // снимает с начала очередей просроченные запросы
+    void expire()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        for (auto& lane : m_lanes)
+        {
+            auto& queue = lane.queue;
+            while (!queue.empty() && queue.begin()->first <= now)
+            {
+                auto& pending = queue.begin()->second;
+                if (pending.request)
+                {
+                    pending.request->slot.clear();
+                    pending.request->queued = false;
+                }
+
+                abort(std::move(pending.handler), boost::asio::error::timed_out);
+                queue.erase(queue.begin());
+            }
+        }
+    }
+
+    bool queuesEmpty() const noexcept
+    {
+        for (const auto& lane : m_lanes)
+            if (!lane.queue.empty())
+                return false;
+
+        return true;
+    }
+
+    // иначе взведенный таймер держит io_service::run до срока уже ушедшего запроса
+    void cancelDeadlineTimer()
+    {
+        boost::system::error_code ignoreEc;
+        m_deadlineTimer.cancel(ignoreEc);
+    }
+
+    void armDeadlineTimer()
+    {
+        auto earliest = std::chrono::steady_clock::time_point::max();
+        for (const auto& lane : m_lanes)
+            if (!lane.queue.empty())
+                earliest = std::min(earliest, lane.queue.begin()->first);
+
+        if (earliest == std::chrono::steady_clock::time_point::max())
+            return;
+
+        const auto left = std::chrono::duration_cast<std::chrono::microseconds>(earliest - std::chrono::steady_clock::now());
+        m_deadlineTimer.expires_from_now(boost::posix_time::microseconds{ std::max<std::int64_t>(left.count(), 0) });
+        m_deadlineTimer.async_wait(m_strand.wrap([this](const boost::system::error_code& ec) {
+            if (ec) // перевзвод или удаление пула, к this не обращаемся
+                return;
+
+            expire();
+            armDeadlineTimer();
+        }));
+    }
+
+    template <typename Op, typename Handler>
+    void start(
+          std::list<Connection>::iterator conn
+        , std::size_t lane
+        , Op&& op
+        , Handler&& handler
+        , std::shared_ptr<RequestState> request
+        , const detail::FlightStamp& enqueued
+        , std::string statement
+        )
+    {
+        ++m_lanes[lane].busy;
+
+        if (request)
+        {
+            request->conn = &*conn;
+            if (!request->queued)
+                watchCancellation(request); // запрос сразу получил соединение
+            request->queued = false;
+        }
+
+        m_affinity.find(&*conn)->second.running = std::move(statement);
+
+        // операция живет в пуле до своего завершения, поэтому может ссылаться на себя из продолжений
+        auto& running = m_running.find(&*conn)->second;
+        running.emplace(std::forward<Op>(op));
+
+        m_strand.get_io_service().post([op{ &*running }, this, conn, lane, handler{ std::forward<Handler>(handler) }, request{ std::move(request) }, enqueued, acquired{ detail::FlightStamp{} }]() mutable {
+            const detail::FlightPoolScope flight{ enqueued, acquired }; // для самописца запросов, см. flight_recorder.hpp
+            (*op)(
+                  *conn
+                , m_strand.wrap([this, conn, lane, handler{ std::move(handler) }, request{ std::move(request) }](const boost::system::error_code& ec) mutable {
+                      handleExec(conn, lane, std::move(handler), ec, request);
+                  })
+                );
+        });
+    }
+
     template <typename Handler>
     void handleExec(
           std::list<Connection>::iterator conn
+        , std::size_t lane
         , Handler&& handler
-        , const boost::system::error_code& ec
+        , boost::system::error_code ec
+        , const std::shared_ptr<RequestState>& request
         )
     {
-        const bool opQueueEmpty = m_opQueue.empty();
+        m_running.find(&*conn)->second = boost::none;
+        rememberStatement(*conn, ec);
+
+        if (request)
+        {
+            request->slot.clear();
+            request->conn = nullptr;
+            if (ec && request->cancelled)
+                ec = boost::asio::error::operation_aborted;
+        }
+
+        --m_lanes[lane].busy;
+
+        // ожидающие, которым можно отдать conn с учетом резервов
+        const bool opQueueEmpty = !hasAdmissible(m_ready.size() + 1);
         if (opQueueEmpty)
             setReady(conn); // объявляем conn свободным, т.к. очередь операций пуста
 
@@ -97,6 +471,44 @@ private:
         startOnePending(conn); // в очереди еще есть, запускаем следующий
     }
 
+    // свободное соединение, где команда уже подготовлена, иначе последнее освободившееся
+    std::list<Connection>::iterator pickReady(const std::string& statement)
+    {
+        if (!statement.empty())
+        {
+            for (auto conn = m_ready.begin(); conn != m_ready.end(); ++conn)
+            {
+                const auto& affinity = m_affinity.find(&*conn)->second;
+                if (affinity.generation == conn->generation() && affinity.statements.count(statement))
+                    return conn;
+            }
+        }
+
+        return m_ready.begin();
+    }
+
+    void rememberStatement(const Connection& conn, const boost::system::error_code& ec)
+    {
+        auto& affinity = m_affinity.find(&conn)->second;
+        const std::string statement = std::move(affinity.running);
+        affinity.running.clear();
+        if (ec || statement.empty())
+            return;
+
+        // после переподключения подготовленных команд на сервере больше нет
+        if (affinity.generation != conn.generation())
+        {
+            affinity.generation = conn.generation();
+            affinity.statements.clear();
+        }
+
+        // имена, которые больше не встречаются, не должны копиться вечно
+        if (affinity.statements.size() >= MAX_AFFINITY_STATEMENTS)
+            affinity.statements.clear();
+
+        affinity.statements.insert(statement);
+    }
+
     void setReady(std::list<Connection>::iterator conn)
     {
         m_ready.splice(m_ready.begin(), m_busy, conn);
@@ -109,17 +521,19 @@ private:
 
     void startOnePending(std::list<Connection>::iterator conn)
     {
-        auto& pair = m_opQueue.front();
+        // пока шел хендлер, очередь могли опустошить отменой, а сроки части запросов - истечь
+        expire();
+        const std::size_t lane = pickLane(m_ready.size() + 1);
+        if (lane == m_lanes.size())
+            return setReady(conn);
 
-        m_strand.get_io_service().post([pair{ std::move(pair) }, this, conn]() mutable {
-            auto& op = pair.first;
-            auto& handler = pair.second;
-            op(*conn, m_strand.wrap([this, conn, handler{ std::move(handler) }](const boost::system::error_code& ec) mutable {
-                handleExec(conn, std::move(handler), ec);
-            }));
-        });
+        auto& queue = m_lanes[lane].queue;
+        auto pending = std::move(queue.begin()->second);
+        queue.erase(queue.begin());
+        if (queuesEmpty())
+            cancelDeadlineTimer();
 
-        m_opQueue.pop();
+        start(conn, lane, std::move(pending.op), std::move(pending.handler), std::move(pending.request), pending.enqueued, std::move(pending.statement));
     }
 
 private:
@@ -129,11 +543,50 @@ private:
             , void(boost::system::error_code, const Connection*)
             >::type;
 
+    struct Pending
+    {
+        Operation op;
+        TrueCompletionHandler handler;
+        std::shared_ptr<RequestState> request;
+        detail::FlightStamp enqueued;
+        std::string statement;
+    };
+
+    // Что пул знает о подготовленных командах соединения: только предпочтение при выборе,
+    // готовит команды по-прежнему сама операция
+    struct Affinity
+    {
+        std::uint64_t generation = 0; // Connection::generation подключения, к которому относятся statements
+        std::unordered_set<std::string> statements;
+        std::string running; // команда выполняющейся операции
+    };
+
+    static constexpr std::size_t MAX_AFFINITY_STATEMENTS = 1'024;
+
+    struct Lane
+    {
+        explicit Lane(const PoolLane& options)
+            : reserved{ options.reserved }
+            , weight{ long(options.weight) }
+        {
+        }
+
+        Queue queue;
+        std::size_t reserved;
+        std::size_t busy = 0;
+        long weight;
+        long current = 0;
+    };
+
 private:
     boost::asio::io_service::strand m_strand;
     std::list<Connection> m_ready;
     std::list<Connection> m_busy;
-    std::queue<std::pair<Operation, TrueCompletionHandler>> m_opQueue;
+    std::unordered_map<const Connection*, boost::optional<Operation>> m_running;
+    std::unordered_map<const Connection*, Affinity> m_affinity;
+    std::vector<Lane> m_lanes;
+    boost::asio::deadline_timer m_deadlineTimer;
+    const bool m_weighted;
 };
 
 } // namespace asiopq
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <functional>
+
+#include "../layer1/result.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer2/params.hpp"
+#include "transaction.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct CursorOptions
+{
+    std::size_t initialRows = 1'000; // строк в первом FETCH
+    std::size_t minRows = 16;
+    std::size_t maxRows = 100'000;
+    std::size_t targetBytes = 4 * 1024 * 1024; // желаемый объем пачки, по нему подбирается число строк
+    bool textResultFormat = true;
+};
+
+namespace detail {
+
+inline std::string makeCursorName()
+{
+    static std::atomic<unsigned> counter{ 0 };
+    return "asiopq_cursor_" + std::to_string(++counter);
+}
+
+// Состояние курсора, общее для Cursor и хендлеров выполняющихся команд.
+// Держит копию транзакции, чтобы она не откатилась, пока курсор открыт.
+struct CursorState
+{
+    CursorState(Transaction&& tx, const CursorOptions& options)
+        : tx{ std::move(tx) }
+        , options{ options }
+        , name{ makeCursorName() }
+        , rows{ std::min(std::max(options.initialRows, options.minRows), options.maxRows) }
+    {
+    }
+
+    Transaction tx;
+    const CursorOptions options;
+    const std::string name;
+    std::string command; // текущая команда, живет до ее отправки
+    std::size_t rows; // строк в следующем FETCH
+
+    Result current; // пачка, отданная вызывающему
+    Result next;    // пачка, полученная заранее
+    boost::system::error_code nextEc;
+
+    std::function<void(const boost::system::error_code&, const ::PGresult*)> fetchHandler; // ждет окончания FETCH
+    std::function<void(const boost::system::error_code&)> closeHandler; // ждет окончания CLOSE
+
+    bool opened = false;    // DECLARE выполнен
+    bool inFlight = false;  // FETCH отправлен и не завершился
+    bool exhausted = false; // последний FETCH вернул меньше строк, чем просили
+    bool closing = false;   // CLOSE отправлен или будет отправлен после FETCH
+    bool closed = false;    // курсора на сервере больше нет
+};
+
+inline void finishClose(const std::shared_ptr<CursorState>& state, const boost::system::error_code& ec)
+{
+    state->closing = true;
+    state->closed = true;
+
+    auto closeHandler = std::move(state->closeHandler);
+    state->closeHandler = nullptr;
+    if (closeHandler)
+        invokeHandler(std::move(closeHandler), ec);
+}
+
+inline void sendClose(const std::shared_ptr<CursorState>& state)
+{
+    state->closing = true;
+    state->command = "CLOSE " + state->name;
+    state->tx.asyncQuery(state->command.c_str(), [state](const boost::system::error_code& ec) {
+        finishClose(state, ec);
+    });
+}
+
+// число строк следующего FETCH по средней ширине строки полученной пачки
+inline void adaptRows(CursorState& state, const ::PGresult* res)
+{
+    const int nTuples = ::PQntuples(res);
+    if (0 == nTuples)
+        return;
+
+    const int nFields = ::PQnfields(res);
+    std::size_t bytes = 0;
+    for (int row = 0; row < nTuples; ++row)
+        for (int field = 0; field < nFields; ++field)
+            bytes += std::size_t(::PQgetlength(res, row, field));
+
+    const std::size_t width = std::max<std::size_t>(1, bytes / std::size_t(nTuples));
+    state.rows = std::min(std::max(state.options.targetBytes / width, state.options.minRows), state.options.maxRows);
+}
+
+inline void deliverFetch(const std::shared_ptr<CursorState>& state, std::function<void(const boost::system::error_code&, const ::PGresult*)>&& handler);
+
+// FETCH следующей пачки, пока вызывающий разбирает текущую
+inline void prefetch(const std::shared_ptr<CursorState>& state)
+{
+    state->inFlight = true;
+    const std::size_t requested = state->rows;
+    state->command = "FETCH FORWARD " + std::to_string(requested) + " FROM " + state->name;
+    state->tx.asyncQueryParams(
+          state->command.c_str()
+        , NullParams{}
+        , state->options.textResultFormat
+        , [state, requested](const boost::system::error_code& ec) {
+              state->inFlight = false;
+              state->nextEc = ec;
+
+              if (ec) // транзакция прервана, курсор закрылся вместе с ней
+                  finishClose(state, ec);
+              else
+              {
+                  state->exhausted = !state->next || std::size_t(state->next.rows()) < requested;
+                  if (state->next)
+                      adaptRows(*state, state->next.get());
+
+                  if (state->closing) // курсор закрыли, пока шел FETCH
+                      sendClose(state);
+              }
+
+              auto fetchHandler = std::move(state->fetchHandler);
+              state->fetchHandler = nullptr;
+              if (fetchHandler)
+                  deliverFetch(state, std::move(fetchHandler));
+          }
+        , KeepResult{ state->next }
+        );
+}
+
+inline void deliverFetch(const std::shared_ptr<CursorState>& state, std::function<void(const boost::system::error_code&, const ::PGresult*)>&& handler)
+{
+    const auto ec = state->nextEc;
+    state->current = std::move(state->next);
+    state->next = Result{};
+
+    const bool empty = !state->current || 0 == state->current.rows();
+    if (!ec && state->exhausted && empty && !state->closed)
+    {
+        // об окончании сообщаем после CLOSE, чтобы транзакция была свободна для следующих команд
+        state->closeHandler = [handler{ std::move(handler) }](const boost::system::error_code& ec) mutable {
+            invokeHandler(std::move(handler), ec, static_cast<const ::PGresult*>(nullptr));
+        };
+        if (!state->closing)
+            sendClose(state);
+        return;
+    }
+
+    if (!ec && !state->exhausted && !state->closing)
+        prefetch(state);
+
+    invokeHandler(std::move(handler), ec, empty ? nullptr : state->current.get());
+}
+
+} // namespace detail
+
+// Серверный курсор в транзакции: большие выборки читаются пачками с постоянным расходом памяти
+// и снимком данных транзакции. Следующий FETCH отправляется сразу при выдаче пачки,
+// пока вызывающий ее разбирает, размер пачки подстраивается под ширину строк (targetBytes).
+// Курсор закрывается сам по исчерпании данных (до выдачи nullptr) или при удалении Cursor до исчерпания.
+// Команды курсора идут через транзакцию: перед следующими командами транзакции курсор нужно дочитать
+// или закрыть asyncClose, брошенный курсор лишь не дает транзакции откатиться раньше своего CLOSE.
+// Как и Transaction, не потокобезопасен.
+class Cursor
+{
+public:
+    Cursor(const Cursor&) = delete;
+    Cursor& operator=(const Cursor&) = delete;
+    Cursor(Cursor&&) = default;
+    Cursor& operator=(Cursor&&) = default;
+
+    explicit Cursor(Transaction tx, const CursorOptions& options = {})
+        : m_state{ std::make_shared<detail::CursorState>(std::move(tx), options) }
+    {
+    }
+
+    ~Cursor()
+    {
+        if (!m_state || m_state->closing || !m_state->opened)
+            return;
+
+        if (m_state->inFlight)
+            m_state->closing = true; // CLOSE уйдет после FETCH
+        else
+            detail::sendClose(m_state);
+    }
+
+    // DECLARE ... NO SCROLL CURSOR FOR query и первый FETCH.
+    // query и params нужны только на время вызова
+    template <typename Params, typename Handler>
+    auto asyncOpen(const char* query, const Params& params, Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        m_state->command = "DECLARE " + m_state->name + " NO SCROLL CURSOR FOR ";
+        m_state->command += query;
+        m_state->tx.asyncQueryParams(
+              m_state->command.c_str()
+            , params
+            , m_state->options.textResultFormat
+            , [state{ m_state }, handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+                  if (!ec)
+                  {
+                      state->opened = true;
+                      detail::prefetch(state);
+                  }
+
+                  detail::invokeHandler(std::move(handler), ec);
+              }
+            );
+
+        return init.result.get();
+    }
+
+    // Хендлер: void(const boost::system::error_code&, const PGresult*).
+    // Результат действителен до следующего asyncFetch или удаления Cursor, nullptr - данные кончились
+    template <typename Handler>
+    auto asyncFetch(Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, const ::PGresult*)>
+            init{ std::forward<Handler>(handler) };
+
+        assert(m_state->opened && !m_state->fetchHandler);
+
+        if (m_state->inFlight)
+        {
+            m_state->fetchHandler = std::move(init.handler);
+        }
+        else
+        {
+            // пачка уже получена, но хендлер не должен вызываться внутри инициирующей функции
+            m_state->tx.connection().get_io_service().post([state{ m_state }, handler{ std::move(init.handler) }]() mutable {
+                detail::deliverFetch(state, std::move(handler));
+            });
+        }
+
+        return init.result.get();
+    }
+
+    // закрывает курсор до исчерпания данных, транзакция продолжается
+    template <typename Handler>
+    auto asyncClose(Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        if (m_state->closed || !m_state->opened)
+        {
+            m_state->tx.connection().get_io_service().post([handler{ std::move(init.handler) }]() mutable {
+                detail::invokeHandler(std::move(handler), boost::system::error_code{});
+            });
+        }
+        else
+        {
+            m_state->closeHandler = std::move(init.handler);
+            if (m_state->inFlight)
+                m_state->closing = true; // CLOSE уйдет после FETCH
+            else if (!m_state->closing)
+                detail::sendClose(m_state);
+        }
+
+        return init.result.get();
+    }
+
+private:
+    std::shared_ptr<detail::CursorState> m_state;
+};
+
+} // namespace asiopq
+} // namespace ba
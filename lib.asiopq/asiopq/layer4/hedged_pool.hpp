@@ -0,0 +1,367 @@
+#pragma once
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#include <boost/asio/deadline_timer.hpp>
+
+#include "../layer1/result.hpp"
+#include "../layer1/cancellation.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer2/async_query_params.hpp"
+#include "reconnection_pool.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct HedgeOptions
+{
+    // задержка, после которой отправляется дубль; not_a_date_time - перцентиль недавних задержек
+    boost::posix_time::time_duration delay = boost::posix_time::not_a_date_time;
+    double percentile = 0.95;
+    // границы адаптивной задержки, пока замеров мало - maxDelay
+    boost::posix_time::time_duration minDelay = boost::posix_time::milliseconds{ 1 };
+    boost::posix_time::time_duration maxDelay = boost::posix_time::seconds{ 1 };
+    // дублей не больше этой доли запросов, burst - сколько дублей можно накопить в запас
+    double budget = 0.05;
+    double burst = 10;
+};
+
+struct HedgedPoolOptions
+{
+    std::size_t connections = 4; // на реплику
+    HedgeOptions hedge;
+    ReconnectionOptions reconnection;
+    ConnectionPoolOptions pool;
+};
+
+namespace detail {
+
+// Перцентиль задержек по последним Window замерам, пересчитывается раз в Recompute замеров
+class LatencyTracker
+{
+    static constexpr std::size_t Window = 512;
+    static constexpr std::size_t Recompute = 32;
+
+public:
+    explicit LatencyTracker(double percentile)
+        : m_percentile{ std::min(std::max(percentile, 0.0), 1.0) }
+    {
+        m_samples.reserve(Window);
+    }
+
+    void record(boost::posix_time::time_duration latency)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_samples.size() < Window)
+            m_samples.push_back(latency.total_microseconds());
+        else
+            m_samples[m_next] = latency.total_microseconds();
+        m_next = (m_next + 1) % Window;
+
+        if (0 == ++m_recorded % Recompute)
+        {
+            auto sorted = m_samples;
+            const auto nth = sorted.begin() + std::ptrdiff_t(m_percentile * double(sorted.size() - 1));
+            std::nth_element(sorted.begin(), nth, sorted.end());
+            m_estimate = *nth;
+        }
+    }
+
+    // -1 - замеров пока мало
+    std::int64_t estimate() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return m_estimate;
+    }
+
+private:
+    const double m_percentile;
+    mutable std::mutex m_mutex;
+    std::vector<std::int64_t> m_samples;
+    std::size_t m_next = 0;
+    std::size_t m_recorded = 0;
+    std::int64_t m_estimate = -1;
+};
+
+// Бюджет дублей: каждый запрос добавляет budget, дубль тратит единицу
+class HedgeBudget
+{
+public:
+    explicit HedgeBudget(const HedgeOptions& options)
+        : m_rate{ options.budget }
+        , m_burst{ options.burst }
+    {
+    }
+
+    void deposit()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        m_tokens = std::min(m_tokens + m_rate, m_burst);
+    }
+
+    bool withdraw()
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        if (m_tokens < 1)
+            return false;
+
+        m_tokens -= 1;
+        return true;
+    }
+
+private:
+    const double m_rate;
+    const double m_burst;
+    std::mutex m_mutex;
+    double m_tokens = 0;
+};
+
+// Две попытки одного запроса: побеждает первый успех, проигравшая отменяется на сервере.
+// Ошибка побеждает, только если другой попытки в работе нет.
+template <typename MakeOp, typename Handler>
+class HedgeState
+    : public std::enable_shared_from_this<HedgeState<MakeOp, Handler>>
+{
+public:
+    HedgeState(boost::asio::io_service& ios, LatencyTracker& tracker, MakeOp&& makeOp, Handler&& handler)
+        : m_timer{ ios }
+        , m_tracker{ tracker }
+        , m_makeOp{ std::move(makeOp) }
+        , m_handler{ std::move(handler) }
+    {
+    }
+
+    MakeOp& makeOp() noexcept
+    {
+        return m_makeOp;
+    }
+
+    boost::asio::deadline_timer& timer() noexcept
+    {
+        return m_timer;
+    }
+
+    CancellationSlot start(std::size_t attempt)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        ++m_running;
+        m_started[attempt] = boost::posix_time::microsec_clock::universal_time();
+        return m_signals[attempt].slot();
+    }
+
+    // false - запрос уже завершен и дубль не нужен
+    bool hedging() const
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        return !m_done;
+    }
+
+    void complete(std::size_t attempt, const boost::system::error_code& ec)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            --m_running;
+            if (m_done || (ec && m_running > 0))
+                return; // проигравшая попытка либо ошибка, пока жива другая
+
+            m_done = true;
+            boost::system::error_code ignoreEc;
+            m_timer.cancel(ignoreEc);
+        }
+
+        m_signals[1 - attempt].emit();
+        if (!ec)
+            m_tracker.record(boost::posix_time::microsec_clock::universal_time() - m_started[attempt]);
+
+        invokeHandler(std::move(m_handler), ec, attempt);
+    }
+
+    void cancel()
+    {
+        for (auto& signal : m_signals)
+            signal.emit();
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    boost::asio::deadline_timer m_timer;
+    LatencyTracker& m_tracker;
+    MakeOp m_makeOp;
+    Handler m_handler;
+    std::array<CancellationSignal, 2> m_signals;
+    std::array<boost::posix_time::ptime, 2> m_started;
+    unsigned m_running = 0;
+    bool m_done = false;
+};
+
+} // namespace detail
+
+// Чтение с реплик с дублированием хвостовых запросов: если попытка не ответила за delay (по умолчанию
+// перцентиль недавних задержек), тот же запрос уходит на следующую реплику, побеждает первый ответ,
+// проигравший отменяется на сервере, его соединение возвращается в пул. Дубли ограничены бюджетом.
+// Только для идемпотентных операций чтения: обе попытки могут выполниться целиком.
+// С одной репликой дублей нет: дубль ушел бы на тот же медленный сервер, запросы идут как через обычный пул.
+// Потокобезопасен, как и пулы реплик.
+template <
+      typename Operation = PolymorphicOperationType
+    , typename CompletionHandler = std::function<void(const boost::system::error_code&, const Connection*)>
+    >
+class HedgedPool
+{
+public:
+    using Pool = ReconnectionPool<Operation, CompletionHandler>;
+
+    HedgedPool(const HedgedPool&) = delete;
+    HedgedPool& operator=(const HedgedPool&) = delete;
+    HedgedPool(HedgedPool&&) = delete;
+    HedgedPool& operator=(HedgedPool&&) = delete;
+
+    HedgedPool(boost::asio::io_service& ios, const std::vector<std::string>& replicas, const HedgedPoolOptions& options = {})
+        : m_ios{ ios }
+        , m_options{ options.hedge }
+        , m_tracker{ options.hedge.percentile }
+        , m_budget{ options.hedge }
+    {
+        if (replicas.empty())
+            throw std::invalid_argument("HedgedPool needs at least one replica");
+
+        for (const auto& conninfo : replicas)
+            m_replicas.push_back(std::make_unique<Pool>(ios, options.connections, conninfo, options.reconnection, options.pool));
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_replicas.size();
+    }
+
+    Pool& replica(std::size_t index)
+    {
+        return *m_replicas[index];
+    }
+
+    // текущая задержка перед дублем
+    boost::posix_time::time_duration hedgeDelay() const
+    {
+        if (!m_options.delay.is_special())
+            return m_options.delay;
+
+        const std::int64_t estimate = m_tracker.estimate();
+        if (estimate < 0)
+            return m_options.maxDelay;
+
+        return std::min(std::max(boost::posix_time::time_duration{ boost::posix_time::microseconds{ estimate } }, m_options.minDelay), m_options.maxDelay);
+    }
+
+    // makeOp(attempt) строит операцию попытки 0 (основной) или 1 (дубль), у каждой попытки свое место для результата.
+    // Хендлер: void(const boost::system::error_code&, std::size_t attempt) - какая попытка победила.
+    // Проигравшая может еще писать в свое место после хендлера, пока не вернется.
+    template <typename MakeOp, typename Handler>
+    auto asyncHedged(MakeOp&& makeOp, Handler&& handler, RequestOptions options = {})
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, std::size_t)>
+            init{ std::forward<Handler>(handler) };
+
+        using State = detail::HedgeState<std::decay_t<MakeOp>, decltype(init.handler)>;
+        auto state = std::make_shared<State>(m_ios, m_tracker, std::decay_t<MakeOp>(std::forward<MakeOp>(makeOp)), std::move(init.handler));
+
+        if (options.cancellation.connected())
+            options.cancellation.assign([state] { state->cancel(); });
+
+        const std::size_t primary = m_next++ % m_replicas.size();
+
+        // таймер заводится до запуска попытки, чтобы завершение попытки всегда находило его взведенным
+        if (m_replicas.size() > 1)
+        {
+            m_budget.deposit();
+            state->timer().expires_from_now(hedgeDelay());
+            state->timer().async_wait([this, state, primary, options](const boost::system::error_code& ec) {
+                if (ec || !state->hedging() || !m_budget.withdraw())
+                    return;
+
+                submit(state, 1, (primary + 1) % m_replicas.size(), options);
+            });
+        }
+
+        submit(state, 0, primary, options);
+
+        return init.result.get();
+    }
+
+    // Запрос с дублированием, хендлер: void(const boost::system::error_code&, const PGresult*),
+    // результат победившей попытки действителен только во время вызова хендлера
+    template <typename Params, typename Handler>
+    auto asyncHedgedQuery(std::string query, Params params, bool textResultFormat, Handler&& handler, RequestOptions options = {})
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, const ::PGresult*)>
+            init{ std::forward<Handler>(handler) };
+
+        struct Query
+        {
+            std::string text;
+            Params params;
+            bool textResultFormat;
+            std::array<Result, 2> results;
+        };
+        auto shared = std::make_shared<Query>(Query{ std::move(query), std::move(params), textResultFormat, {} });
+
+        asyncHedged(
+              [shared](std::size_t attempt) {
+                  return [shared, attempt](Connection& conn, auto&& handler) {
+                      asyncQueryParams(
+                            conn
+                          , shared->text.c_str()
+                          , shared->params
+                          , shared->textResultFormat
+                          , std::forward<decltype(handler)>(handler)
+                          , KeepResult{ shared->results[attempt] }
+                          );
+                  };
+              }
+            , [shared, handler{ std::move(init.handler) }](const boost::system::error_code& ec, std::size_t attempt) mutable {
+                  detail::invokeHandler(std::move(handler), ec, ec ? nullptr : shared->results[attempt].get());
+              }
+            , std::move(options)
+            );
+
+        return init.result.get();
+    }
+
+private:
+    template <typename State>
+    void submit(const std::shared_ptr<State>& state, std::size_t attempt, std::size_t replica, const RequestOptions& options)
+    {
+        RequestOptions attemptOptions;
+        attemptOptions.cancellation = state->start(attempt);
+        attemptOptions.deadline = options.deadline;
+        attemptOptions.priority = options.priority;
+        attemptOptions.statement = options.statement;
+
+        (*m_replicas[replica])(
+              state->makeOp()(attempt)
+            , [state, attempt](const boost::system::error_code& ec, const Connection*) {
+                  state->complete(attempt, ec);
+              }
+            , std::move(attemptOptions)
+            );
+    }
+
+private:
+    boost::asio::io_service& m_ios;
+    const HedgeOptions m_options;
+    detail::LatencyTracker m_tracker;
+    detail::HedgeBudget m_budget;
+    std::atomic<std::size_t> m_next{ 0 };
+    std::vector<std::unique_ptr<Pool>> m_replicas;
+};
+
+} // namespace asiopq
+} // namespace ba
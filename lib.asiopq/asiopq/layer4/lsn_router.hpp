@@ -0,0 +1,393 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <stdexcept>
+#include <functional>
+
+#include <boost/asio/deadline_timer.hpp>
+
+#include "../layer1/ignore_result.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer2/async_query.hpp"
+#include "../layer3/replication_stream.hpp"
+#include "reconnection_pool.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct LsnRouterOptions
+{
+    std::size_t connections = 4; // на каждый сервер
+    // как часто узнавать у реплик воспроизведенную позицию WAL, по одному запросу на реплику
+    boost::posix_time::time_duration pollInterval = boost::posix_time::milliseconds{ 20 };
+    // сколько чтение ждет реплику, догнавшую его LSN, затем уходит на основной сервер;
+    // проверяется с шагом pollInterval
+    boost::posix_time::time_duration maxWait = boost::posix_time::milliseconds{ 100 };
+    ReconnectionOptions reconnection;
+    ConnectionPoolOptions pool;
+};
+
+namespace detail {
+
+// коллектор одного значения LSN, NULL (например, pg_last_wal_replay_lsn на основном сервере) - 0
+class LsnResult
+{
+public:
+    explicit LsnResult(std::uint64_t& out)
+        : m_out{ &out }
+    {
+    }
+
+    boost::system::error_code operator()(const ::PGresult* res) const
+    {
+        if (res && PGRES_TUPLES_OK == ::PQresultStatus(res) && 1 == ::PQntuples(res))
+            *m_out = ::PQgetisnull(res, 0, 0) ? 0 : parseLsn(::PQgetvalue(res, 0, 0));
+
+        return IgnoreResult{}(res);
+    }
+
+private:
+    std::uint64_t* m_out;
+};
+
+} // namespace detail
+
+// Чтение своих записей с реплик. Пишущие операции идут на основной сервер, и хендлер получает
+// позицию WAL после операции (pg_current_wal_lsn() тем же соединением): это токен, который
+// вызывающий передает со следующими чтениями (между запросами - formatLsn/parseLsn).
+// Чтение с токеном уходит только на реплику, воспроизведшую WAL не меньше токена; такой нет - ждет
+// до maxWait, затем выполняется на основном сервере. Позиции реплик опрашиваются в фоне после startPolling.
+// Потокобезопасен. Объект должен жить, пока не завершатся все операции; запущенный опрос перед удалением
+// останавливают через asyncStopPolling: его запросы выполняются пулами этого объекта.
+template <
+      typename Operation = PolymorphicOperationType
+    , typename CompletionHandler = std::function<void(const boost::system::error_code&, const Connection*)>
+    >
+class LsnRouter
+{
+public:
+    using Pool = ReconnectionPool<Operation, CompletionHandler>;
+
+    static constexpr std::size_t PRIMARY = std::size_t(-1);
+    // токен записи, позицию которой узнать не удалось: чтения с ним сразу идут на основной сервер
+    static constexpr std::uint64_t PRIMARY_LSN = std::numeric_limits<std::uint64_t>::max();
+
+    LsnRouter(const LsnRouter&) = delete;
+    LsnRouter& operator=(const LsnRouter&) = delete;
+    LsnRouter(LsnRouter&&) = delete;
+    LsnRouter& operator=(LsnRouter&&) = delete;
+
+    LsnRouter(boost::asio::io_service& ios, const std::string& primary, const std::vector<std::string>& replicas, const LsnRouterOptions& options = {})
+        : m_options{ options }
+        , m_primary{ std::make_unique<Pool>(ios, options.connections, primary, options.reconnection, options.pool) }
+        , m_state{ std::make_shared<State>(replicas.size()) }
+        , m_timer{ ios }
+    {
+        for (const auto& conninfo : replicas)
+            m_replicas.push_back(std::make_unique<Pool>(ios, options.connections, conninfo, options.reconnection, options.pool));
+    }
+
+    ~LsnRouter()
+    {
+        assert(!m_state->polling && 0 == m_state->inFlight && "LsnRouter destroyed while polling, see asyncStopPolling");
+    }
+
+    Pool& primary()
+    {
+        return *m_primary;
+    }
+
+    std::size_t replicas() const noexcept
+    {
+        return m_replicas.size();
+    }
+
+    Pool& replica(std::size_t index)
+    {
+        return *m_replicas[index];
+    }
+
+    // последняя узнанная позиция реплики, 0 - неизвестна
+    std::uint64_t replayedLsn(std::size_t index) const noexcept
+    {
+        return m_state->replayed[index];
+    }
+
+    void startPolling()
+    {
+        std::lock_guard<std::mutex> lock{ m_state->mutex };
+        if (m_state->polling)
+            return;
+
+        m_state->polling = true;
+        tick();
+    }
+
+    // ожидающие чтения уходят на основной сервер, уже отправленные запросы позиций завершаются сами
+    void stopPolling()
+    {
+        for (auto& waiter : stop({}))
+            waiter.route(PRIMARY);
+    }
+
+    // Как stopPolling, хендлер void(const boost::system::error_code&) вызывается, когда завершатся
+    // все отправленные запросы позиций: после него объект можно удалять
+    template <typename Handler>
+    auto asyncStopPolling(Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        auto& ios = m_timer.get_io_service();
+        for (auto& waiter : stop([&ios, handler{ std::move(init.handler) }]() mutable {
+                ios.post([handler{ std::move(handler) }]() mutable {
+                    detail::invokeHandler(std::move(handler), boost::system::error_code{});
+                });
+            }))
+            waiter.route(PRIMARY);
+
+        return init.result.get();
+    }
+
+    // Пишущая операция на основном сервере, хендлер: void(const boost::system::error_code&, std::uint64_t lsn).
+    // Запрос позиции после успешной op ошибкой не считается: запись уже выполнена, повторять ее нельзя,
+    // поэтому при его сбое хендлер получает успех и токен PRIMARY_LSN
+    template <typename Op, typename Handler>
+    auto asyncWrite(Op&& op, Handler&& handler, RequestOptions options = {})
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, std::uint64_t)>
+            init{ std::forward<Handler>(handler) };
+
+        auto lsn = std::make_shared<std::uint64_t>(0);
+        (*m_primary)(
+              [op{ std::forward<Op>(op) }, lsn](Connection& conn, auto&& handler) mutable {
+                  op(conn, [&conn, lsn, handler{ std::forward<decltype(handler)>(handler) }](const boost::system::error_code& ec) mutable {
+                      if (ec)
+                          return detail::invokeHandler(std::move(handler), ec);
+
+                      asyncQuery(
+                            conn
+                          , "SELECT pg_current_wal_lsn()"
+                          , [lsn, handler{ std::move(handler) }](const boost::system::error_code& ec) mutable {
+                                if (ec || 0 == *lsn) // NULL тоже не годится: 0 снимает требование свежести
+                                    *lsn = PRIMARY_LSN;
+
+                                detail::invokeHandler(std::move(handler), boost::system::error_code{});
+                            }
+                          , detail::LsnResult{ *lsn }
+                          );
+                  });
+              }
+            , [lsn, handler{ std::move(init.handler) }](const boost::system::error_code& ec, const Connection*) mutable {
+                  detail::invokeHandler(std::move(handler), ec, *lsn);
+              }
+            , std::move(options)
+            );
+
+        return init.result.get();
+    }
+
+    // Читающая операция с токеном lsn (0 - без требований к свежести), хендлер как у пула.
+    // Без реплик и без опроса, а также с токеном PRIMARY_LSN чтение выполняется на основном сервере.
+    template <typename Op, typename Handler>
+    auto asyncRead(std::uint64_t lsn, Op&& op, Handler&& handler, RequestOptions options = {})
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, const Connection*)>
+            init{ std::forward<Handler>(handler) };
+
+        std::function<void(std::size_t)> route = [
+              this
+            , op{ Operation(std::forward<Op>(op)) }
+            , handler{ std::move(init.handler) }
+            , options{ std::move(options) }
+            ](std::size_t target) mutable {
+                Pool& pool = PRIMARY == target ? *m_primary : *m_replicas[target];
+                pool(std::move(op), std::move(handler), std::move(options));
+            };
+
+        std::size_t target = PRIMARY;
+        {
+            std::lock_guard<std::mutex> lock{ m_state->mutex };
+            target = pick(lsn);
+            if (PRIMARY == target && 0 != lsn && PRIMARY_LSN != lsn && m_state->polling && !m_replicas.empty() && m_options.maxWait.ticks() > 0)
+            {
+                const auto deadline = boost::posix_time::microsec_clock::universal_time() + m_options.maxWait;
+                m_state->waiters.push_back(Waiter{ lsn, deadline, std::move(route) });
+                return init.result.get();
+            }
+        }
+
+        route(target);
+        return init.result.get();
+    }
+
+private:
+    static constexpr std::size_t WAIT = PRIMARY - 1; // для release: оставить ждать
+
+    struct Waiter
+    {
+        std::uint64_t lsn;
+        boost::posix_time::ptime deadline;
+        std::function<void(std::size_t)> route;
+    };
+
+    // Состояние опроса. Хендлеры таймера и запросов позиций держат его, а не объект: они могут прийти
+    // после удаления LsnRouter и к самому объекту обращаются, только пока опрос идет (polling под mutex)
+    struct State
+    {
+        explicit State(std::size_t replicas)
+            : replayed(replicas)
+            , polls(replicas)
+        {
+        }
+
+        std::mutex mutex;
+        std::vector<std::atomic<std::uint64_t>> replayed;
+        std::vector<bool> polls; // идет запрос позиции реплики
+        std::size_t inFlight = 0; // сколько запросов позиций еще не вернулось
+        std::function<void()> stopped; // хендлер asyncStopPolling, ждет последний запрос позиции
+        std::list<Waiter> waiters;
+        std::size_t next = 0;
+        bool polling = false;
+    };
+
+    // снимает опрос и возвращает ожидающих; stopped вызывается, когда запросов позиций в пути не останется
+    std::list<Waiter> stop(std::function<void()> stopped)
+    {
+        std::list<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock{ m_state->mutex };
+            m_state->polling = false;
+            boost::system::error_code ignoreEc;
+            m_timer.cancel(ignoreEc);
+            waiters.swap(m_state->waiters);
+
+            if (0 != m_state->inFlight)
+                m_state->stopped = std::move(stopped);
+            else if (stopped)
+                stopped();
+        }
+
+        return waiters;
+    }
+
+    // реплика по кругу среди догнавших lsn, под m_state->mutex
+    std::size_t pick(std::uint64_t lsn)
+    {
+        const std::size_t n = m_replicas.size();
+        for (std::size_t i = 0; i != n; ++i)
+        {
+            const std::size_t index = (m_state->next + i) % n;
+            // без опроса позиции неизвестны, годится любая реплика для чтения без токена
+            if (m_state->polling ? m_state->replayed[index] >= std::max<std::uint64_t>(lsn, 1) : 0 == lsn)
+            {
+                m_state->next = index + 1;
+                return index;
+            }
+        }
+
+        return PRIMARY;
+    }
+
+    // под m_state->mutex
+    void tick()
+    {
+        for (std::size_t index = 0; index != m_replicas.size(); ++index)
+            poll(index);
+
+        m_timer.expires_from_now(m_options.pollInterval);
+        m_timer.async_wait([this, state{ m_state }](const boost::system::error_code& ec) {
+            if (ec) // stopPolling или удаление, к this не обращаемся
+                return;
+
+            std::lock_guard<std::mutex> lock{ state->mutex };
+            if (!state->polling) // таймер мог сработать одновременно с остановкой, объекта уже может не быть
+                return;
+
+            release([now{ boost::posix_time::microsec_clock::universal_time() }](const Waiter& waiter) {
+                return waiter.deadline <= now ? PRIMARY : WAIT;
+            });
+            tick();
+        });
+    }
+
+    void poll(std::size_t index)
+    {
+        if (m_state->polls[index]) // предыдущий опрос еще идет
+            return;
+
+        m_state->polls[index] = true;
+        ++m_state->inFlight;
+        auto lsn = std::make_shared<std::uint64_t>(0);
+        (*m_replicas[index])(
+              [lsn](Connection& conn, auto&& handler) {
+                  asyncQuery(conn, "SELECT pg_last_wal_replay_lsn()", std::forward<decltype(handler)>(handler), detail::LsnResult{ *lsn });
+              }
+            , [this, state{ m_state }, index, lsn](const boost::system::error_code& ec, const Connection*) {
+                  std::lock_guard<std::mutex> lock{ state->mutex };
+                  state->polls[index] = false;
+                  --state->inFlight;
+                  state->replayed[index] = ec ? 0 : *lsn; // недоступная реплика не получает чтений с токеном
+
+                  if (!state->polling) // после остановки ожидающих нет, к this не обращаемся
+                  {
+                      if (0 == state->inFlight && state->stopped)
+                          std::exchange(state->stopped, {})(); // лишь ставит хендлер в очередь io_service
+                      return;
+                  }
+
+                  const std::uint64_t replayed = state->replayed[index];
+                  release([index, replayed](const Waiter& waiter) {
+                      return 0 != replayed && waiter.lsn <= replayed ? index : WAIT;
+                  });
+              }
+            );
+    }
+
+    // Отправляет ожидающих, для которых select вернул цель, а не WAIT, под m_state->mutex.
+    // Отправка лишь ставит операцию в очередь пула, хендлеры под m_state->mutex не исполняются
+    template <typename Select>
+    void release(Select&& select)
+    {
+        for (auto waiter = m_state->waiters.begin(); waiter != m_state->waiters.end();)
+        {
+            const std::size_t target = select(*waiter);
+            if (WAIT == target)
+            {
+                ++waiter;
+                continue;
+            }
+
+            waiter->route(target);
+            waiter = m_state->waiters.erase(waiter);
+        }
+    }
+
+private:
+    const LsnRouterOptions m_options;
+    std::unique_ptr<Pool> m_primary;
+    std::vector<std::unique_ptr<Pool>> m_replicas;
+    const std::shared_ptr<State> m_state;
+    boost::asio::deadline_timer m_timer; // под m_state->mutex
+};
+
+template <typename Operation, typename CompletionHandler>
+constexpr std::size_t LsnRouter<Operation, CompletionHandler>::PRIMARY;
+
+template <typename Operation, typename CompletionHandler>
+constexpr std::uint64_t LsnRouter<Operation, CompletionHandler>::PRIMARY_LSN;
+
+template <typename Operation, typename CompletionHandler>
+constexpr std::size_t LsnRouter<Operation, CompletionHandler>::WAIT;
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <functional>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/ignore_result.hpp"
+#include "../layer1/result.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer2/async_query_params.hpp"
+#include "../layer3/cloned_params.hpp"
+
+namespace ba {
+namespace asiopq {
+
+using CachedResult = std::shared_ptr<const ::PGresult>;
+
+struct QueryCacheOptions
+{
+    std::size_t byteBudget = 64 * 1024 * 1024;
+    std::chrono::steady_clock::duration ttl = std::chrono::seconds{ 60 };
+    // канал NOTIFY -> префикс SQL-текста, записи с которым сбрасываются по уведомлению
+    std::multimap<std::string, std::string> invalidations;
+};
+
+namespace detail {
+
+// ключ: текст команды и байты параметров, одинаковые запросы дают одинаковый ключ
+template <typename Params>
+std::string makeCacheKey(const char* command, const Params& params, bool textResultFormat)
+{
+    std::string key{ command };
+    key += '\0';
+    key += textResultFormat ? 't' : 'b';
+
+    const int n = params.n();
+    const Oid* const types = params.types();
+    const char* const* const values = params.values();
+    const int* const lengths = params.lengths();
+    const int* const formats = params.formats();
+
+    for (int i = 0; i < n; ++i)
+    {
+        const bool binary = formats && 0 != formats[i];
+        const Oid type = types ? types[i] : 0;
+        key.append(reinterpret_cast<const char*>(&type), sizeof(type));
+
+        if (!values[i])
+        {
+            key += 'N';
+            continue;
+        }
+
+        const std::size_t length = binary ? std::size_t(lengths[i]) : std::strlen(values[i]);
+        key += binary ? 'B' : 'T';
+        key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        key.append(values[i], length);
+    }
+
+    return key;
+}
+
+inline std::size_t resultBytes(const ::PGresult* res) noexcept
+{
+    constexpr std::size_t CELL_OVERHEAD = 16; // примерно sizeof(PGresAttValue)
+
+    std::size_t bytes = sizeof(void*) * 32;
+    const int nTuples = ::PQntuples(res);
+    const int nFields = ::PQnfields(res);
+    for (int row = 0; row < nTuples; ++row)
+        for (int field = 0; field < nFields; ++field)
+            bytes += CELL_OVERHEAD + std::size_t(::PQgetlength(res, row, field));
+
+    return bytes;
+}
+
+// забирает последний результат с данными без копирования
+class SnapshotCollector
+{
+public:
+    using TakesOwnership = std::true_type;
+
+    explicit SnapshotCollector(CachedResult& snapshot)
+        : m_snapshot{ &snapshot }
+    {
+    }
+
+    boost::system::error_code operator()(Result res) const
+    {
+        const auto ec = IgnoreResult{}(res.get());
+        if (!ec && res && PGRES_TUPLES_OK == res.status())
+            *m_snapshot = std::move(res).share();
+
+        return ec;
+    }
+
+private:
+    CachedResult* m_snapshot;
+};
+
+} // namespace detail
+
+// Кеш результатов идемпотентных запросов перед пулом.
+// Записи живут ttl и вытесняются по LRU при превышении byteBudget, попадание в кеш не обращается к серверу.
+// Одновременные промахи по одному ключу объединяются в один запрос.
+// Сброс - по уведомлениям с соединения, переданного в listen, согласно options.invalidations.
+// Хендлер: void(const boost::system::error_code&, CachedResult).
+// Запросы идут через Pool с произвольными операциями, см. PolymorphicOperationType.
+// Объект должен жить, пока не завершатся все запросы.
+template <typename Pool>
+class QueryCache
+{
+    using Waiter = std::function<void(const boost::system::error_code&, CachedResult)>;
+
+    // LRU хранит указатели на ключи из State::entries, ключи в std::map не перемещаются
+    using Lru = std::list<const std::string*>;
+
+    struct Entry
+    {
+        CachedResult result;
+        std::size_t bytes;
+        std::chrono::steady_clock::time_point expires;
+        Lru::iterator lru;
+    };
+
+    using Entries = std::map<std::string, Entry>;
+
+    struct Pending
+    {
+        std::vector<Waiter> waiters;
+        bool stale = false; // пока шел запрос, ключ сбросили, результат в кеш не кладем
+    };
+
+    // Записи кеша. Подписка на уведомления держит их через weak_ptr: NotificationHub вызывает подписчиков
+    // без блокировки, и уже начатая раздача может прийти после отписки в деструкторе QueryCache
+    struct State
+    {
+        explicit State(QueryCacheOptions&& options)
+            : options{ std::move(options) }
+        {
+        }
+
+        void invalidate(const std::string& prefix)
+        {
+            std::lock_guard<std::mutex> lock{ mutex };
+
+            for (auto it = entries.lower_bound(prefix); it != entries.end() && 0 == it->first.compare(0, prefix.size(), prefix);)
+                erase(it++);
+
+            for (auto it = pending.lower_bound(prefix); it != pending.end() && 0 == it->first.compare(0, prefix.size(), prefix); ++it)
+                it->second.stale = true;
+        }
+
+        // под mutex
+        void insert(const std::string& key, const CachedResult& result)
+        {
+            const std::size_t size = key.size() + detail::resultBytes(result.get());
+            if (size > options.byteBudget)
+                return;
+
+            while (bytes + size > options.byteBudget)
+                erase(entries.find(*lru.back()));
+
+            auto it = entries.emplace(key, Entry{ result, size, std::chrono::steady_clock::now() + options.ttl, {} }).first;
+            lru.push_front(&it->first);
+            it->second.lru = lru.begin();
+            bytes += size;
+        }
+
+        // под mutex
+        void erase(typename Entries::iterator it)
+        {
+            bytes -= it->second.bytes;
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+
+        const QueryCacheOptions options;
+        std::mutex mutex;
+        Entries entries;
+        Lru lru;
+        std::size_t bytes = 0;
+        std::map<std::string, Pending> pending;
+    };
+
+public:
+    QueryCache(const QueryCache&) = delete;
+    QueryCache& operator=(const QueryCache&) = delete;
+
+    QueryCache(boost::asio::io_service& ios, Pool& pool, QueryCacheOptions options = {})
+        : m_ios{ ios }
+        , m_pool{ pool }
+        , m_state{ std::make_shared<State>(std::move(options)) }
+    {
+    }
+
+    ~QueryCache()
+    {
+        if (m_listener)
+            for (const auto subscription : m_subscriptions)
+                m_listener->unsubscribe(subscription);
+    }
+
+    // conn должен выполнить asyncListen на каналы из options.invalidations и startListening.
+    // После переподключения conn уведомления могли потеряться, кеш стоит сбросить через clear
+    void listen(Connection& conn)
+    {
+        m_listener = &conn;
+
+        // по одной подписке на канал, подписка сбрасывает все префиксы канала
+        const auto& invalidations = m_state->options.invalidations;
+        for (auto channel = invalidations.begin(); channel != invalidations.end(); channel = invalidations.upper_bound(channel->first))
+            m_subscriptions.push_back(conn.subscribe(channel->first, [weakState{ std::weak_ptr<State>{ m_state } }](const Notification& n) {
+                const auto state = weakState.lock();
+                if (!state) // кеш уже удален
+                    return;
+
+                const auto range = state->options.invalidations.equal_range(n.channel);
+                for (auto it = range.first; it != range.second; ++it)
+                    state->invalidate(it->second);
+            }));
+    }
+
+    // потокобезопасен
+    template <typename Params, typename Handler>
+    auto operator()(const char* command, const Params& params, bool textResultFormat, Handler&& handler)
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, CachedResult)>
+            init{ std::forward<Handler>(handler) };
+
+        std::string key = detail::makeCacheKey(command, params, textResultFormat);
+
+        std::unique_lock<std::mutex> lock{ m_state->mutex };
+
+        const auto found = m_state->entries.find(key);
+        if (found != m_state->entries.end())
+        {
+            if (found->second.expires > std::chrono::steady_clock::now())
+            {
+                m_state->lru.splice(m_state->lru.begin(), m_state->lru, found->second.lru);
+                CachedResult result = found->second.result;
+                lock.unlock();
+
+                m_ios.post([handler{ std::move(init.handler) }, result{ std::move(result) }]() mutable {
+                    detail::invokeHandler(std::move(handler), boost::system::error_code{}, result);
+                });
+                return init.result.get();
+            }
+
+            m_state->erase(found);
+        }
+
+        auto pending = m_state->pending.find(key);
+        if (pending != m_state->pending.end())
+        {
+            pending->second.waiters.emplace_back(std::move(init.handler));
+            return init.result.get();
+        }
+
+        m_state->pending[key].waiters.emplace_back(std::move(init.handler));
+        lock.unlock();
+
+        auto snapshot = std::make_shared<CachedResult>();
+        m_pool(
+              [command{ std::string{ command } }, params{ ClonedParams{ params } }, textResultFormat, snapshot](Connection& conn, auto&& handler) {
+                  asyncQueryParams(conn, command.c_str(), params, textResultFormat, std::forward<decltype(handler)>(handler), detail::SnapshotCollector{ *snapshot });
+              }
+            , [this, key{ std::move(key) }, snapshot](const boost::system::error_code& ec, const Connection*) {
+                  complete(key, ec, ec ? CachedResult{} : *snapshot);
+              }
+            );
+
+        return init.result.get();
+    }
+
+    // сбрасывает все записи, SQL-текст которых начинается с prefix
+    void invalidate(const std::string& prefix)
+    {
+        m_state->invalidate(prefix);
+    }
+
+    void clear()
+    {
+        invalidate({});
+    }
+
+private:
+    void complete(const std::string& key, const boost::system::error_code& ec, CachedResult result)
+    {
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> lock{ m_state->mutex };
+
+            auto pending = m_state->pending.find(key);
+            assert(pending != m_state->pending.end());
+            waiters = std::move(pending->second.waiters);
+            const bool stale = pending->second.stale;
+            m_state->pending.erase(pending);
+
+            if (!ec && result && !stale)
+                m_state->insert(key, result);
+        }
+
+        for (auto& waiter : waiters)
+            m_ios.post([waiter{ std::move(waiter) }, ec, result]() mutable {
+                detail::invokeHandler(std::move(waiter), ec, result);
+            });
+    }
+
+private:
+    boost::asio::io_service& m_ios;
+    Pool& m_pool;
+    const std::shared_ptr<State> m_state;
+    Connection* m_listener = nullptr;
+    std::vector<std::size_t> m_subscriptions;
+};
+
+} // namespace asiopq
+} // namespace ba
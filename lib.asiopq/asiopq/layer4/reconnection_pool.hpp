@@ -2,25 +2,219 @@
 
 #include "connection_pool.hpp"
 #include "../utility.hpp"
+#include "../layer3/any_operation.hpp"
+#include "../layer3/connection_bootstrap.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+
+#include <boost/asio/deadline_timer.hpp>
 
 namespace ba {
 namespace asiopq {
 
+struct ReconnectionOptions
+{
+    // задержка перед повторным подключением соединения растет от initialBackoff до maxBackoff,
+    // фактическая задержка выбирается случайно от нуля до текущей, чтобы соединения не ломились в сервер разом
+    boost::posix_time::time_duration initialBackoff = boost::posix_time::milliseconds{ 50 };
+    boost::posix_time::time_duration maxBackoff = boost::posix_time::seconds{ 10 };
+    // после стольких неудачных подключений подряд по всему пулу цепь размыкается,
+    // операции, которым нужно подключение, сразу завершаются с PQError::CIRCUIT_OPEN
+    unsigned failureThreshold = 5;
+    // через openTimeout одно подключение пробует сервер, при успехе цепь замыкается
+    boost::posix_time::time_duration openTimeout = boost::posix_time::seconds{ 5 };
+};
+
+namespace detail {
+
+// Состояние переподключений, общее для всех соединений пула
+class ReconnectionBreaker
+{
+public:
+    explicit ReconnectionBreaker(const ReconnectionOptions& options)
+        : m_options{ options }
+        , m_random{ std::random_device{}() }
+    {
+    }
+
+    // можно ли подключаться сейчас и через сколько
+    boost::system::error_code acquire(const Connection* conn, boost::posix_time::time_duration& delay)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+        delay = boost::posix_time::time_duration{};
+
+        switch (m_state)
+        {
+        case State::CLOSED:
+            break;
+        case State::OPEN:
+            if (std::chrono::steady_clock::now() - m_openedAt < std::chrono::microseconds{ m_options.openTimeout.total_microseconds() })
+                return make_error_code(PQError::CIRCUIT_OPEN);
+
+            m_state = State::HALF_OPEN;
+            m_probe = conn;
+            return {}; // пробное подключение без задержки
+        case State::HALF_OPEN:
+            return make_error_code(PQError::CIRCUIT_OPEN); // пока проба не вернулась, остальные не подключаются
+        }
+
+        const auto found = m_failures.find(conn);
+        if (found == m_failures.end())
+            return {};
+
+        const unsigned shift = std::min(found->second - 1, 20u);
+        const auto limit = std::min(
+              m_options.initialBackoff.total_microseconds() << shift
+            , m_options.maxBackoff.total_microseconds()
+            );
+        delay = boost::posix_time::microseconds{ std::uniform_int_distribution<std::int64_t>{ 0, limit }(m_random) };
+        return {};
+    }
+
+    void record(const Connection* conn, const boost::system::error_code& ec)
+    {
+        std::lock_guard<std::mutex> lock{ m_mutex };
+
+        if (!ec)
+        {
+            m_failures.erase(conn);
+            m_consecutiveFailures = 0;
+            m_state = State::CLOSED;
+            return;
+        }
+
+        ++m_failures[conn];
+        ++m_consecutiveFailures;
+
+        if ((State::HALF_OPEN == m_state && conn == m_probe) || (State::CLOSED == m_state && m_consecutiveFailures >= m_options.failureThreshold))
+        {
+            m_state = State::OPEN;
+            m_openedAt = std::chrono::steady_clock::now();
+        }
+    }
+
+private:
+    enum class State
+    {
+        CLOSED,
+        OPEN,
+        HALF_OPEN
+    };
+
+private:
+    const ReconnectionOptions m_options;
+    std::mutex m_mutex;
+    std::minstd_rand m_random;
+    State m_state = State::CLOSED;
+    std::chrono::steady_clock::time_point m_openedAt;
+    const Connection* m_probe = nullptr;
+    unsigned m_consecutiveFailures = 0;
+    std::unordered_map<const Connection*, unsigned> m_failures;
+};
+
+// Операция подключения с задержкой и проверкой состояния пула
+template <typename ConnectOp>
+struct GuardedConnectOperation
+{
+    template <typename Handler>
+    void operator()(Connection& conn, Handler&& handler)
+    {
+        boost::posix_time::time_duration delay;
+        const auto ec = breaker->acquire(&conn, delay);
+        if (ec)
+        {
+            conn.get_io_service().post([handler{ std::forward<Handler>(handler) }, ec]() mutable {
+                invokeHandler(std::move(handler), ec);
+            });
+            return;
+        }
+
+        if (delay.ticks() <= 0)
+            return connect(conn, std::forward<Handler>(handler));
+
+        auto timer = std::make_shared<boost::asio::deadline_timer>(conn.get_io_service(), delay);
+        timer->async_wait([self{ *this }, timer, &conn, handler{ std::forward<Handler>(handler) }](const boost::system::error_code&) mutable {
+            self.connect(conn, std::move(handler));
+        });
+    }
+
+    template <typename Handler>
+    void connect(Connection& conn, Handler&& handler)
+    {
+        connectOp(conn, [breaker{ breaker }, &conn, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+            breaker->record(&conn, ec);
+            invokeHandler(std::move(handler), ec);
+        });
+    }
+
+    ConnectOp connectOp;
+    std::shared_ptr<ReconnectionBreaker> breaker;
+};
+
+// Как makeCheckedOperation, но без копии операции: после переподключения повторяется тот же экземпляр,
+// поэтому операция может быть только перемещаемой, но должна допускать повторный вызов.
+// Пул держит операцию до ее завершения, поэтому продолжения ссылаются на нее по указателю,
+// а хендлер пула на время переподключения хранится в ней же, и connectOp получает копируемый хендлер
+// без выделения памяти (подходит и для std::function).
+template <typename Op, typename ConnectOp>
+class CheckedOperation
+{
+public:
+    CheckedOperation(Op&& op, ConnectOp& connectOp)
+        : m_op{ std::move(op) }
+        , m_connectOp{ &connectOp }
+    {
+    }
+
+    template <typename Handler>
+    void operator()(Connection& conn, Handler&& handler)
+    {
+        m_op(conn, [this, &conn, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+            if (!ec || ::PQstatus(conn.get()) == ::CONNECTION_OK)
+                return invokeHandler(std::move(handler), ec);
+
+            m_parked = std::move(handler);
+            (*m_connectOp)(conn, [this, &conn](const boost::system::error_code& ec) {
+                reconnected(conn, ec);
+            });
+        });
+    }
+
+private:
+    void reconnected(Connection& conn, const boost::system::error_code& ec)
+    {
+        if (!ec)
+            return m_op(conn, std::move(m_parked));
+
+        // хендлер может удалить операцию вместе с m_parked
+        auto handler = std::move(m_parked);
+        handler(ec);
+    }
+
+private:
+    Op m_op;
+    ConnectOp* m_connectOp;
+    AnyHandler m_parked;
+};
+
+template <typename Operation, typename ConnectOp>
+using GuardedCheckedOperation = CheckedOperation<Operation, GuardedConnectOperation<ConnectOp>>;
+
+} // namespace detail
+
 template <
       typename Operation
     , typename CompletionHandler
     , typename ConnectOp = PolymorphicOperationType
     >
 class ReconnectionPool
-    : public ConnectionPool<
-          decltype(makeCheckedOperation(std::declval<Operation>(), std::declval<ConnectOp>()))
-        , CompletionHandler
-        >
+    : public ConnectionPool<detail::GuardedCheckedOperation<Operation, ConnectOp>, CompletionHandler>
 {
-    using Base = ConnectionPool<
-          decltype(makeCheckedOperation(std::declval<Operation>(), std::declval<ConnectOp>()))
-        , CompletionHandler
-        >;
+    using Base = ConnectionPool<detail::GuardedCheckedOperation<Operation, ConnectOp>, CompletionHandler>;
 
 public:
     ReconnectionPool(const ReconnectionPool&) = delete;
@@ -28,20 +222,26 @@ public:
     ReconnectionPool(ReconnectionPool&&) = delete;
     ReconnectionPool& operator=(ReconnectionPool&&) = delete;
 
-    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, ConnectOp&& connectOp)
-        : Base{ ios, size }
-        , m_connectOp{ std::move(connectOp) }
+    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, ConnectOp&& connectOp, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
+        : Base{ ios, size, poolOptions }
+        , m_connectOp{ std::move(connectOp), std::make_shared<detail::ReconnectionBreaker>(options) }
     {
     }
 
-    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, const ConnectOp& connectOp)
-        : Base{ ios, size }
-        , m_connectOp{ connectOp }
+    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, const ConnectOp& connectOp, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
+        : Base{ ios, size, poolOptions }
+        , m_connectOp{ connectOp, std::make_shared<detail::ReconnectionBreaker>(options) }
     {
     }
 
-    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, std::string conninfo)
-        : ReconnectionPool{ ios, size,  makeConnectOperation(std::move(conninfo))}
+    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, std::string conninfo, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
+        : ReconnectionPool{ ios, size,  makeConnectOperation(std::move(conninfo)), options, poolOptions }
+    {
+    }
+
+    // bootstrap выполняется после каждого подключения соединения, до первой операции на нем
+    ReconnectionPool(boost::asio::io_service& ios, std::size_t size, const std::string& conninfo, ConnectionBootstrap bootstrap, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
+        : ReconnectionPool{ ios, size,  makeConnectOperation(conninfo, std::move(bootstrap)), options, poolOptions }
     {
     }
 
@@ -50,27 +250,33 @@ public:
         , std::size_t size
         , std::map<std::string, std::string> params
         , bool expandDbname = false
+        , const ReconnectionOptions& options = {}
+        , const ConnectionPoolOptions& poolOptions = {}
         )
         : ReconnectionPool{
               ios
             , size
             , makeConnectOperation(std::move(params), expandDbname)
+            , options
+            , poolOptions
             }
     {
     }
 
     // потокобезопасен, как и в базовом классе
     template <typename OtherOp, typename OtherHandler>
-    auto operator()(OtherOp&& op, OtherHandler&& handler)
+    auto operator()(OtherOp&& op, OtherHandler&& handler, RequestOptions options = {})
     {
+        // приводим к Operation, иначе тип проверяемой операции не совпадет с типом очереди базового пула
         return Base::operator()(
-              makeCheckedOperation(std::forward<OtherOp>(op), m_connectOp)
+              detail::GuardedCheckedOperation<Operation, ConnectOp>{ Operation(std::forward<OtherOp>(op)), m_connectOp }
             , std::forward<OtherHandler>(handler)
+            , std::move(options)
             );
     }
 
 private:
-    ConnectOp m_connectOp;
+    detail::GuardedConnectOperation<ConnectOp> m_connectOp;
 };
 
 // make-функции позволяют вывести параметр шаблона ConnectOp
@@ -84,20 +290,27 @@ template <
     , typename ConnectOp
     , std::enable_if_t<std::is_convertible<ConnectOp, PolymorphicOperationType>::value, bool> = true
     >
-auto makeReconnectionPool(boost::asio::io_service& ios, std::size_t size, ConnectOp&& connectOp)
+auto makeReconnectionPool(boost::asio::io_service& ios, std::size_t size, ConnectOp&& connectOp, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
 {
     return std::make_unique<ReconnectionPool<
           Operation
         , CompletionHandler
         , std::decay_t<ConnectOp>
-        >>(ios, size, std::forward<ConnectOp>(connectOp));
+        >>(ios, size, std::forward<ConnectOp>(connectOp), options, poolOptions);
+}
+
+template <typename Operation, typename CompletionHandler>
+auto makeReconnectionPool(boost::asio::io_service& ios, std::size_t size, std::string conninfo, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
+{
+    return makeReconnectionPool<Operation, CompletionHandler>
+        (ios, size, makeConnectOperation(std::move(conninfo)), options, poolOptions);
 }
 
 template <typename Operation, typename CompletionHandler>
-auto makeReconnectionPool(boost::asio::io_service& ios, std::size_t size, std::string conninfo)
+auto makeReconnectionPool(boost::asio::io_service& ios, std::size_t size, const std::string& conninfo, ConnectionBootstrap bootstrap, const ReconnectionOptions& options = {}, const ConnectionPoolOptions& poolOptions = {})
 {
     return makeReconnectionPool<Operation, CompletionHandler>
-        (ios, size, makeConnectOperation(std::move(conninfo)));
+        (ios, size, makeConnectOperation(conninfo, std::move(bootstrap)), options, poolOptions);
 }
 
 template <typename Operation, typename CompletionHandler>
@@ -106,12 +319,16 @@ auto makeReconnectionPool(
     , std::size_t size
     , std::map<std::string, std::string> params
     , bool expandDbname = false
+    , const ReconnectionOptions& options = {}
+    , const ConnectionPoolOptions& poolOptions = {}
     )
 {
     return makeReconnectionPool<Operation, CompletionHandler>(
           ios
         , size
-        , makeConnectOperation(std::move(params), expandDbname));
+        , makeConnectOperation(std::move(params), expandDbname)
+        , options
+        , poolOptions);
 }
 
 } // namespace asiopq
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+
+#include <boost/asio/deadline_timer.hpp>
+
+#include "../error.hpp"
+#include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "transaction.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct RetryPolicy
+{
+    unsigned maxAttempts = 3; // всего попыток, включая первую
+    // задержка перед повтором растет от initialBackoff до maxBackoff, фактическая выбирается случайно от нуля до текущей,
+    // чтобы столкнувшиеся транзакции не столкнулись снова
+    boost::posix_time::time_duration initialBackoff = boost::posix_time::milliseconds{ 10 };
+    boost::posix_time::time_duration maxBackoff = boost::posix_time::milliseconds{ 500 };
+    std::function<bool(const boost::system::error_code&)> retryable; // пусто - повторяются ErrorClass::TRANSIENT
+};
+
+namespace detail {
+
+inline bool shouldRetry(const RetryPolicy& policy, const boost::system::error_code& ec, unsigned attempt)
+{
+    if (!ec || attempt >= policy.maxAttempts)
+        return false;
+
+    return policy.retryable ? policy.retryable(ec) : ErrorClass::TRANSIENT == ec;
+}
+
+inline boost::posix_time::time_duration retryDelay(const RetryPolicy& policy, unsigned attempt)
+{
+    thread_local std::minstd_rand random{ std::random_device{}() };
+
+    const unsigned shift = std::min(attempt - 1, 20u);
+    const auto limit = std::min(
+          policy.initialBackoff.total_microseconds() << shift
+        , policy.maxBackoff.total_microseconds()
+        );
+    return boost::posix_time::microseconds{ std::uniform_int_distribution<std::int64_t>{ 0, limit }(random) };
+}
+
+// Операция пула, которая повторяет op на том же соединении при временных ошибках.
+// Как и CheckedOperation, продолжения ссылаются на операцию по указателю: пул держит ее до завершения.
+// Если соединение оборвалось, ошибка отдается сразу, переподключение - забота ReconnectionPool.
+template <typename Op>
+class RetryingOperation
+{
+public:
+    RetryingOperation(Op&& op, std::shared_ptr<const RetryPolicy> policy)
+        : m_op{ std::move(op) }
+        , m_policy{ std::move(policy) }
+    {
+    }
+
+    template <typename Handler>
+    void operator()(Connection& conn, Handler&& handler)
+    {
+        attempt(conn, 1, std::forward<Handler>(handler));
+    }
+
+private:
+    template <typename Handler>
+    void attempt(Connection& conn, unsigned number, Handler&& handler)
+    {
+        m_op(conn, [this, &conn, number, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+            if (!shouldRetry(*m_policy, ec, number) || ::CONNECTION_OK != ::PQstatus(conn.get()))
+                return invokeHandler(std::move(handler), ec);
+
+            auto timer = std::make_shared<boost::asio::deadline_timer>(conn.get_io_service(), retryDelay(*m_policy, number));
+            timer->async_wait([this, timer, &conn, number, handler{ std::move(handler) }](const boost::system::error_code&) mutable {
+                attempt(conn, number + 1, std::move(handler));
+            });
+        });
+    }
+
+private:
+    Op m_op;
+    std::shared_ptr<const RetryPolicy> m_policy;
+};
+
+// Повторяемая транзакция: каждая попытка в новой транзакции, возможно на другом соединении пула
+template <typename Pool, typename Body, typename Handler>
+class RetryScope
+    : public std::enable_shared_from_this<RetryScope<Pool, Body, Handler>>
+{
+public:
+    RetryScope(boost::asio::io_service& ios, Pool& pool, const TransactionOptions& options, const RetryPolicy& policy, Body&& body, Handler&& handler)
+        : m_ios{ ios }
+        , m_pool{ pool }
+        , m_options{ options }
+        , m_policy{ policy }
+        , m_body{ std::move(body) }
+        , m_handler{ std::move(handler) }
+    {
+    }
+
+    void start(unsigned number)
+    {
+        asyncBeginTransaction(m_pool, m_options, [self{ this->shared_from_this() }, number](const boost::system::error_code& ec, Transaction tx) {
+            if (ec)
+                return self->finish(ec, number, Transaction{});
+
+            self->m_body(tx, [self, number, tx](const boost::system::error_code& ec) mutable {
+                self->finish(ec, number, std::move(tx));
+            });
+        });
+    }
+
+private:
+    void finish(const boost::system::error_code& ec, unsigned number, Transaction tx)
+    {
+        // COMMIT прерванной транзакции сообщает лишь TRANSACTION_ABORTED, решаем по исходной ошибке
+        const auto cause = PQError::TRANSACTION_ABORTED == ec && tx.failure() ? tx.failure() : ec;
+        if (!shouldRetry(m_policy, cause, number))
+            return invokeHandler(std::move(m_handler), cause);
+
+        // незавершенную телом транзакцию откатит ее последняя копия
+        tx = Transaction{};
+
+        auto timer = std::make_shared<boost::asio::deadline_timer>(m_ios, retryDelay(m_policy, number));
+        timer->async_wait([self{ this->shared_from_this() }, timer, number](const boost::system::error_code&) {
+            self->start(number + 1);
+        });
+    }
+
+private:
+    boost::asio::io_service& m_ios; // для задержки между попытками, у пула его не получить
+    Pool& m_pool;
+    const TransactionOptions m_options;
+    const RetryPolicy m_policy;
+    Body m_body;
+    Handler m_handler;
+};
+
+} // namespace detail
+
+// Оборачивает операцию пула: при ошибке, которую policy считает временной, операция повторяется
+// на том же соединении после случайной задержки. Операция должна допускать повторный вызов.
+template <typename Op>
+auto makeRetryingOperation(Op&& op, const RetryPolicy& policy = {})
+{
+    return detail::RetryingOperation<std::decay_t<Op>>{ std::forward<Op>(op), std::make_shared<const RetryPolicy>(policy) };
+}
+
+// Выполняет тело в транзакции и повторяет все заново в новой транзакции при временных ошибках
+// (конфликт сериализации, взаимоблокировка), что обязательно для SERIALIZABLE.
+// body: void(Transaction tx, std::function<void(const boost::system::error_code&)> done) - выполняет команды
+// и вызывает done после COMMIT либо с ошибкой, должно допускать повторный вызов.
+// Хендлер получает результат последней попытки, для прерванной транзакции - исходную ошибку, а не TRANSACTION_ABORTED.
+template <typename Pool, typename Body, typename Handler>
+auto asyncRetryTransaction(boost::asio::io_service& ios, Pool& pool, const TransactionOptions& options, const RetryPolicy& policy, Body&& body, Handler&& handler)
+{
+    detail::async_result_init<Handler, void(boost::system::error_code)>
+        init{ std::forward<Handler>(handler) };
+
+    using Scope = detail::RetryScope<Pool, std::decay_t<Body>, decltype(init.handler)>;
+    std::make_shared<Scope>(ios, pool, options, policy, std::decay_t<Body>(std::forward<Body>(body)), std::move(init.handler))->start(1);
+
+    return init.result.get();
+}
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+
+#include "../layer2/async_query_params.hpp"
+#include "reconnection_pool.hpp"
+#include "when_all.hpp"
+
+namespace ba {
+namespace asiopq {
+
+struct ShardOptions
+{
+    std::string conninfo;
+    std::size_t connections = 4;
+    unsigned weight = 1; // доля ключей пропорциональна весу
+    // имя определяет место шарда на кольце, пусто - conninfo.
+    // Переезд шарда на другой адрес с тем же именем не меняет распределения ключей
+    std::string name;
+};
+
+struct ShardedPoolOptions
+{
+    unsigned virtualNodes = 160; // точек на кольце на единицу веса, больше - ровнее распределение
+    ReconnectionOptions reconnection;
+    ConnectionPoolOptions pool;
+};
+
+namespace detail {
+
+// FNV-1a с финальным перемешиванием murmur3, чтобы близкие ключи расходились по кольцу
+inline std::uint64_t mixShardHash(std::uint64_t hash) noexcept
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+inline std::uint64_t hashShardKey(const char* data, std::size_t size) noexcept
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return mixShardHash(hash);
+}
+
+// Кольцо согласованного хеширования: ключ принадлежит шарду первой точки по часовой стрелке.
+// Точки шарда зависят только от его имени, поэтому новый шард забирает ключи лишь у соседей по кольцу,
+// примерно weight / суммарный вес всех ключей, остальные остаются на месте.
+class HashRing
+{
+public:
+    HashRing(const std::vector<ShardOptions>& shards, unsigned virtualNodes)
+    {
+        for (std::size_t shard = 0; shard < shards.size(); ++shard)
+        {
+            const auto& options = shards[shard];
+            const std::string& name = options.name.empty() ? options.conninfo : options.name;
+            for (unsigned node = 0; node < options.weight * virtualNodes; ++node)
+            {
+                const std::string point = name + '#' + std::to_string(node);
+                m_points.emplace_back(hashShardKey(point.data(), point.size()), shard);
+            }
+        }
+
+        std::sort(m_points.begin(), m_points.end());
+    }
+
+    std::size_t locate(std::uint64_t hash) const noexcept
+    {
+        auto point = std::lower_bound(m_points.begin(), m_points.end(), std::make_pair(hash, std::size_t{ 0 }));
+        if (m_points.end() == point)
+            point = m_points.begin();
+        return point->second;
+    }
+
+private:
+    std::vector<std::pair<std::uint64_t, std::size_t>> m_points;
+};
+
+// Коллектор, общий для всех шардов: результаты приходят с разных соединений, в том числе из разных потоков
+template <typename ResultCollector>
+class SerializedCollector
+{
+public:
+    explicit SerializedCollector(ResultCollector&& collector)
+        : m_state{ std::make_shared<State>(std::move(collector)) }
+    {
+    }
+
+    boost::system::error_code operator()(const ::PGresult* res) const
+    {
+        std::lock_guard<std::mutex> lock{ m_state->mutex };
+        return m_state->collector(res);
+    }
+
+private:
+    struct State
+    {
+        explicit State(ResultCollector&& collector)
+            : collector{ std::move(collector) }
+        {
+        }
+
+        std::mutex mutex;
+        ResultCollector collector;
+    };
+
+    std::shared_ptr<State> m_state;
+};
+
+} // namespace detail
+
+// Пул над несколькими шардами: по ReconnectionPool на шард, операция направляется по ключу шардирования
+// через кольцо согласованного хеширования. Межшардовые запросы - asyncScatter и asyncScatterQuery.
+// Потокобезопасен, как и пулы шардов.
+template <
+      typename Operation = PolymorphicOperationType
+    , typename CompletionHandler = std::function<void(const boost::system::error_code&, const Connection*)>
+    >
+class ShardedPool
+{
+public:
+    using Pool = ReconnectionPool<Operation, CompletionHandler>;
+
+    ShardedPool(const ShardedPool&) = delete;
+    ShardedPool& operator=(const ShardedPool&) = delete;
+    ShardedPool(ShardedPool&&) = delete;
+    ShardedPool& operator=(ShardedPool&&) = delete;
+
+    ShardedPool(boost::asio::io_service& ios, const std::vector<ShardOptions>& shards, const ShardedPoolOptions& options = {})
+        : m_ring{ validate(shards, options), options.virtualNodes }
+    {
+        for (const auto& shard : shards)
+            m_shards.push_back(std::make_unique<Pool>(ios, shard.connections, shard.conninfo, options.reconnection, options.pool));
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_shards.size();
+    }
+
+    std::size_t shardFor(const std::string& key) const noexcept
+    {
+        return m_ring.locate(detail::hashShardKey(key.data(), key.size()));
+    }
+
+    std::size_t shardFor(std::uint64_t key) const noexcept
+    {
+        return m_ring.locate(detail::mixShardHash(key));
+    }
+
+    Pool& shard(std::size_t index)
+    {
+        return *m_shards[index];
+    }
+
+    // операция на шарде ключа, хендлер как у пула: void(const boost::system::error_code&, const Connection*)
+    template <typename Key, typename OtherOp, typename OtherHandler>
+    auto operator()(const Key& key, OtherOp&& op, OtherHandler&& handler, RequestOptions options = {})
+    {
+        return shard(shardFor(key))(std::forward<OtherOp>(op), std::forward<OtherHandler>(handler), std::move(options));
+    }
+
+    // Операция makeOp(shard) на каждом шарде одновременно, хендлер как у asyncWhenAll, errors[i] - результат шарда i
+    template <typename MakeOp, typename Handler>
+    auto asyncScatter(MakeOp&& makeOp, Handler&& handler, WhenAllMode mode = WhenAllMode::WAIT_ALL, RequestOptions options = {})
+    {
+        detail::async_result_init<Handler, void(boost::system::error_code, std::vector<boost::system::error_code>)>
+            init{ std::forward<Handler>(handler) };
+
+        using State = detail::WhenAllState<decltype(init.handler)>;
+        detail::launchWhenAll(
+              std::make_shared<State>(m_shards.size(), mode, options.cancellation, std::move(init.handler))
+            , std::move(options)
+            , [this, &makeOp](std::size_t index, RequestOptions&& shardOptions, auto&& complete) {
+                  shard(index)(makeOp(index), std::forward<decltype(complete)>(complete), std::move(shardOptions));
+              }
+            );
+
+        return init.result.get();
+    }
+
+    // Запрос на всех шардах, результаты сливаются в один коллектор: вызовы коллектора
+    // с разных шардов не пересекаются, порядок шардов не определен.
+    template <typename Params, typename ResultCollector, typename Handler>
+    auto asyncScatterQuery(std::string query, Params params, bool textResultFormat, ResultCollector&& coll, Handler&& handler, WhenAllMode mode = WhenAllMode::WAIT_ALL)
+    {
+        auto query_ = std::make_shared<const std::string>(std::move(query));
+        auto params_ = std::make_shared<const Params>(std::move(params));
+        detail::SerializedCollector<std::decay_t<ResultCollector>> collector{ std::decay_t<ResultCollector>(std::forward<ResultCollector>(coll)) };
+
+        return asyncScatter(
+              [query_, params_, textResultFormat, collector](std::size_t) {
+                  return [query_, params_, textResultFormat, collector](Connection& conn, auto&& handler) {
+                      asyncQueryParams(conn, query_->c_str(), *params_, textResultFormat, std::forward<decltype(handler)>(handler), collector);
+                  };
+              }
+            , std::forward<Handler>(handler)
+            , mode
+            );
+    }
+
+private:
+    static const std::vector<ShardOptions>& validate(const std::vector<ShardOptions>& shards, const ShardedPoolOptions& options)
+    {
+        if (shards.empty())
+            throw std::invalid_argument("ShardedPool needs at least one shard");
+
+        if (0 == options.virtualNodes)
+            throw std::invalid_argument("ShardedPool virtual nodes count can't be zero");
+
+        for (const auto& shard : shards)
+            if (0 == shard.weight)
+                throw std::invalid_argument("ShardedPool shard weight can't be zero");
+
+        return shards;
+    }
+
+private:
+    detail::HashRing m_ring;
+    std::vector<std::unique_ptr<Pool>> m_shards;
+};
+
+} // namespace asiopq
+} // namespace ba
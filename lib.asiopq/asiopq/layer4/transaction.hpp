@@ -0,0 +1,467 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <cstring>
+#include <functional>
+
+#include "../layer1/connection.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "../layer2/async_query.hpp"
+#include "../layer2/async_query_params.hpp"
+#include "../layer2/params.hpp"
+#include "../layer3/cloned_params.hpp"
+
+namespace ba {
+namespace asiopq {
+
+enum class IsolationLevel
+{
+    DEFAULT, // как настроено на сервере (default_transaction_isolation)
+    READ_COMMITTED,
+    REPEATABLE_READ,
+    SERIALIZABLE
+};
+
+struct TransactionOptions
+{
+    IsolationLevel isolation = IsolationLevel::DEFAULT;
+    bool readOnly = false;
+};
+
+class Transaction;
+
+namespace detail {
+
+inline std::string makeBeginCommand(const TransactionOptions& options)
+{
+    std::string command = "BEGIN";
+
+    switch (options.isolation)
+    {
+    case IsolationLevel::READ_COMMITTED:
+        command += " ISOLATION LEVEL READ COMMITTED";
+        break;
+    case IsolationLevel::REPEATABLE_READ:
+        command += " ISOLATION LEVEL REPEATABLE READ";
+        break;
+    case IsolationLevel::SERIALIZABLE:
+        command += " ISOLATION LEVEL SERIALIZABLE";
+        break;
+    default:
+        break;
+    }
+
+    if (options.readOnly)
+        command += " READ ONLY";
+
+    return command;
+}
+
+// Пропускает в пользовательский коллектор только результаты команды с номером target,
+// остальные (BEGIN, COMMIT) проверяются как в IgnoreResult. Команды разделяет nullptr.
+// Владение результатом передается дальше, если его берет пользовательский коллектор.
+template <typename ResultCollector>
+class StepCollector
+{
+public:
+    using TakesOwnership = std::true_type;
+
+    StepCollector(int target, ResultCollector&& coll)
+        : m_target{ target }
+        , m_coll{ std::forward<ResultCollector>(coll) }
+    {
+    }
+
+    boost::system::error_code operator()(Result res)
+    {
+        const int current = res ? m_current : m_current++;
+        if (current == m_target)
+            return detail::collectResult(m_coll, std::move(res));
+
+        return IgnoreResult{}(res.get());
+    }
+
+private:
+    int m_current = 0;
+    const int m_target;
+    ResultCollector m_coll;
+};
+
+// Состояние транзакции, общее для всех копий Transaction и завершающих хендлеров
+struct TransactionState
+{
+    explicit TransactionState(const TransactionOptions& options)
+        : begin{ makeBeginCommand(options) }
+    {
+    }
+
+    void release(const boost::system::error_code& ec)
+    {
+        finished = true;
+        conn = nullptr;
+
+        auto releaseConn = std::move(this->releaseConn);
+        this->releaseConn = nullptr;
+        if (releaseConn)
+            releaseConn(ec); // соединение возвращается в пул
+    }
+
+    Connection* conn = nullptr;
+    std::function<void(const boost::system::error_code&)> releaseConn;
+    std::string begin; // пустая строка, когда BEGIN уже отправлен
+    bool failed = false; // одна из команд завершилась ошибкой, транзакция на сервере в состоянии aborted
+    boost::system::error_code failure; // первая ошибка команды, например SQLSTATE конфликта сериализации
+    bool closing = false; // COMMIT или ROLLBACK уже отправлен
+    bool finished = false;
+};
+
+// Последняя копия Transaction, которая пропала без COMMIT/ROLLBACK, откатывает транзакцию и возвращает соединение.
+// Хендлеры выполняющихся команд держат копию Transaction, поэтому откат не пересечется с командой.
+class TransactionGuard
+{
+public:
+    explicit TransactionGuard(std::shared_ptr<TransactionState> state)
+        : m_state{ std::move(state) }
+    {
+    }
+
+    ~TransactionGuard()
+    {
+        if (m_state->finished || m_state->closing)
+            return;
+
+        rollbackAndRelease(m_state, [](const boost::system::error_code&) {});
+    }
+
+    TransactionState& state() const noexcept
+    {
+        return *m_state;
+    }
+
+    const std::shared_ptr<TransactionState>& sharedState() const noexcept
+    {
+        return m_state;
+    }
+
+    template <typename Handler>
+    static void rollbackAndRelease(const std::shared_ptr<TransactionState>& state, Handler&& handler)
+    {
+        if (!state->begin.empty()) // BEGIN не отправляли, откатывать нечего
+        {
+            state->release({});
+            return handler(boost::system::error_code{});
+        }
+
+        asyncQuery(*state->conn, "ROLLBACK", [state, handler{ std::forward<Handler>(handler) }](const boost::system::error_code& ec) mutable {
+            state->release(ec); // если соединение сломано, пул с переподключением это увидит
+            handler(ec);
+        });
+    }
+
+private:
+    std::shared_ptr<TransactionState> m_state;
+};
+
+template <typename Handler>
+class TransactionLease;
+
+} // namespace detail
+
+// Транзакция на соединении, арендованном у пула на все время ее жизни.
+// BEGIN отправляется вместе с первой командой, COMMIT можно отправить вместе с последней (методы ...AndCommit),
+// при наличии конвейера libpq это один проход до сервера вместо трех.
+// Если последняя копия пропала без COMMIT/ROLLBACK, транзакция откатывается до возврата соединения в пул.
+// Команды одной транзакции выполняются строго последовательно, как и на Connection.
+class Transaction
+{
+public:
+    Transaction() = default;
+
+    bool valid() const noexcept
+    {
+        return m_guard && !m_guard->state().finished && !m_guard->state().closing;
+    }
+
+    Connection& connection() const noexcept
+    {
+        assert(valid());
+        return *m_guard->state().conn;
+    }
+
+    // ошибка, из-за которой транзакция прервана (asyncCommit в этом случае вернет PQError::TRANSACTION_ABORTED),
+    // доступна и после завершения транзакции
+    boost::system::error_code failure() const noexcept
+    {
+        return m_guard ? m_guard->state().failure : boost::system::error_code{};
+    }
+
+    template <typename Params, typename Handler, typename ResultCollector = IgnoreResult>
+    auto asyncQueryParams(const char* command, const Params& params, bool textResultFormat, Handler&& handler, ResultCollector&& coll = {})
+    {
+        return exec(command, params, textResultFormat, false, std::forward<Handler>(handler), std::forward<ResultCollector>(coll));
+    }
+
+    template <typename Params, typename Handler, typename ResultCollector = IgnoreResult>
+    auto asyncQueryParamsAndCommit(const char* command, const Params& params, bool textResultFormat, Handler&& handler, ResultCollector&& coll = {})
+    {
+        return exec(command, params, textResultFormat, true, std::forward<Handler>(handler), std::forward<ResultCollector>(coll));
+    }
+
+    // в отличие от asyncQuery на Connection, команда должна быть одна: в конвейере multi-statement запрещен
+    template <typename Handler, typename ResultCollector = IgnoreResult>
+    auto asyncQuery(const char* command, Handler&& handler, ResultCollector&& coll = {})
+    {
+        return exec(command, NullParams{}, true, false, std::forward<Handler>(handler), std::forward<ResultCollector>(coll));
+    }
+
+    template <typename Handler, typename ResultCollector = IgnoreResult>
+    auto asyncQueryAndCommit(const char* command, Handler&& handler, ResultCollector&& coll = {})
+    {
+        return exec(command, NullParams{}, true, true, std::forward<Handler>(handler), std::forward<ResultCollector>(coll));
+    }
+
+    // после ошибки любой команды вместо COMMIT выполняется ROLLBACK, хендлер получает PQError::TRANSACTION_ABORTED
+    template <typename Handler>
+    auto asyncCommit(Handler&& handler)
+    {
+        return finish("COMMIT", std::forward<Handler>(handler));
+    }
+
+    template <typename Handler>
+    auto asyncRollback(Handler&& handler)
+    {
+        return finish("ROLLBACK", std::forward<Handler>(handler));
+    }
+
+private:
+    template <typename Handler>
+    friend class detail::TransactionLease;
+
+    explicit Transaction(std::shared_ptr<detail::TransactionGuard> guard)
+        : m_guard{ std::move(guard) }
+    {
+    }
+
+    template <typename Params, typename Handler, typename ResultCollector>
+    auto exec(const char* command, const Params& params, bool textResultFormat, bool commit, Handler&& handler, ResultCollector&& coll)
+    {
+        assert(valid());
+
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        auto& state = m_guard->state();
+        std::string begin = std::move(state.begin);
+        state.begin.clear();
+
+        // хендлер держит копию транзакции, чтобы она не откатилась, пока команда выполняется
+        auto onComplete = [self{ *this }, commit, handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+            self.complete(ec, commit, std::move(handler));
+        };
+
+#ifdef LIBPQ_HAS_PIPELINING
+        const int target = begin.empty() ? 0 : 1;
+        state.conn->asyncExecPipeline(
+              [pgConn{ state.conn->get() }, begin{ std::move(begin) }, command, &params, textResultFormat, commit]{
+                if (!::PQenterPipelineMode(pgConn))
+                    return make_error_code(PQError::PIPELINE_FAILED);
+
+                if (!begin.empty() && !::PQsendQueryParams(pgConn, begin.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 0))
+                    return make_error_code(PQError::SEND_QUERY_PARAMS_FAILED);
+
+                if (!::PQsendQueryParams(pgConn, command, params.n(), params.types(), params.values(), params.lengths(), params.formats(), textResultFormat ? 0 : 1))
+                    return make_error_code(PQError::SEND_QUERY_PARAMS_FAILED);
+
+                if (commit && !::PQsendQueryParams(pgConn, "COMMIT", 0, nullptr, nullptr, nullptr, nullptr, 0))
+                    return make_error_code(PQError::SEND_QUERY_PARAMS_FAILED);
+
+                if (!::PQpipelineSync(pgConn))
+                    return make_error_code(PQError::PIPELINE_FAILED);
+
+                return boost::system::error_code{};
+              }
+            , 1
+            , std::move(onComplete)
+            , detail::StepCollector<ResultCollector>{ target, std::forward<ResultCollector>(coll) }
+            );
+#else
+        // без конвейера BEGIN и COMMIT уходят отдельными командами,
+        // команда и параметры копируются, т.к. отправляются уже после BEGIN
+        auto& conn = *state.conn;
+        auto sendCommand = [
+              &conn
+            , command{ std::string{ command } }
+            , params{ ClonedParams{ params } }
+            , textResultFormat
+            , commit
+            , collHolder{ std::tuple<ResultCollector>{ std::forward<ResultCollector>(coll) } }
+            , onComplete{ std::move(onComplete) }
+            ](const boost::system::error_code& ec) mutable {
+                if (ec)
+                    return onComplete(ec);
+
+                asiopq::asyncQueryParams(
+                      conn
+                    , command.c_str()
+                    , params
+                    , textResultFormat
+                    , [&conn, commit, onComplete{ std::move(onComplete) }](const boost::system::error_code& ec) mutable {
+                        if (ec || !commit)
+                            return onComplete(ec);
+
+                        asiopq::asyncQuery(conn, "COMMIT", std::move(onComplete));
+                      }
+                    , std::forward<ResultCollector>(std::get<0>(collHolder))
+                    );
+            };
+
+        if (begin.empty())
+            sendCommand(boost::system::error_code{});
+        else
+            asiopq::asyncQuery(conn, begin.c_str(), std::move(sendCommand));
+#endif
+
+        return init.result.get();
+    }
+
+    template <typename Handler>
+    void complete(const boost::system::error_code& ec, bool commit, Handler&& handler)
+    {
+        if (!ec)
+        {
+            if (commit)
+                m_guard->state().release({});
+
+            return detail::invokeHandler(std::forward<Handler>(handler), ec);
+        }
+
+        auto& state = m_guard->state();
+        state.failed = true;
+        if (!state.failure)
+            state.failure = ec;
+
+        if (!commit)
+            return detail::invokeHandler(std::forward<Handler>(handler), ec);
+
+        // COMMIT из конвейера не выполнился, транзакция на сервере осталась в состоянии aborted
+        detail::TransactionGuard::rollbackAndRelease(m_guard->sharedState(), [ec, handler{ std::forward<Handler>(handler) }](const boost::system::error_code&) mutable {
+            detail::invokeHandler(std::move(handler), ec);
+        });
+    }
+
+    template <typename Handler>
+    auto finish(const char* command, Handler&& handler)
+    {
+        assert(valid());
+
+        detail::async_result_init<Handler, void(boost::system::error_code)>
+            init{ std::forward<Handler>(handler) };
+
+        auto& state = m_guard->state();
+        const bool rollback = state.failed || 0 == std::strcmp(command, "ROLLBACK");
+        state.closing = true;
+
+        if (rollback || !state.begin.empty())
+        {
+            auto& ios = state.conn->get_io_service();
+            const auto resultEc = state.failed && 0 != std::strcmp(command, "ROLLBACK")
+                ? make_error_code(PQError::TRANSACTION_ABORTED)
+                : boost::system::error_code{};
+
+            detail::TransactionGuard::rollbackAndRelease(m_guard->sharedState(), [&ios, resultEc, handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+                // хендлер не должен вызываться внутри инициирующей функции
+                ios.post([resultEc, ec, handler{ std::move(handler) }]() mutable {
+                    detail::invokeHandler(std::move(handler), resultEc ? resultEc : ec);
+                });
+            });
+        }
+        else
+        {
+            auto sharedState = m_guard->sharedState();
+            asiopq::asyncQuery(*state.conn, command, [sharedState, handler{ std::move(init.handler) }](const boost::system::error_code& ec) mutable {
+                sharedState->release(ec);
+                detail::invokeHandler(std::move(handler), ec);
+            });
+        }
+
+        return init.result.get();
+    }
+
+private:
+    std::shared_ptr<detail::TransactionGuard> m_guard;
+};
+
+namespace detail {
+
+// Операция пула, которая держит соединение, пока транзакция не завершится
+template <typename Handler>
+class TransactionLease
+{
+public:
+    TransactionLease(const TransactionOptions& options, Handler&& handler)
+        : m_state{ std::make_shared<TransactionState>(options) }
+        , m_handler{ std::move(handler) }
+    {
+    }
+
+    template <typename ReleaseHandler>
+    void acquire(Connection& conn, ReleaseHandler&& releaseConn)
+    {
+        if (m_handedOut) // пул с переподключением повторно запустил операцию после обрыва, транзакция уже отдана
+            return releaseConn(boost::system::error_code{});
+
+        // пул с переподключением переподключит соединение и запустит операцию снова
+        if (::CONNECTION_OK != ::PQstatus(conn.get()))
+            return releaseConn(make_error_code(PQError::CONN_FAILED));
+
+        m_handedOut = true;
+        m_state->conn = &conn;
+        m_state->releaseConn = std::forward<ReleaseHandler>(releaseConn);
+
+        invokeHandler(std::move(m_handler), boost::system::error_code{}, Transaction{ std::make_shared<TransactionGuard>(m_state) });
+    }
+
+    // хендлер пула, соединение вернулось
+    void complete(const boost::system::error_code& ec)
+    {
+        if (m_handedOut)
+            return;
+
+        m_handedOut = true;
+        invokeHandler(std::move(m_handler), ec ? ec : make_error_code(PQError::CONN_FAILED), Transaction{});
+    }
+
+private:
+    std::shared_ptr<TransactionState> m_state;
+    Handler m_handler;
+    bool m_handedOut = false;
+};
+
+} // namespace detail
+
+// Арендует соединение у пула и отдает хендлеру транзакцию: void handler(const boost::system::error_code&, Transaction).
+// Требования к Pool - см. PolymorphicOperationType.
+template <typename Pool, typename Handler>
+auto asyncBeginTransaction(Pool& pool, const TransactionOptions& options, Handler&& handler)
+{
+    detail::async_result_init<Handler, void(boost::system::error_code, Transaction)>
+        init{ std::forward<Handler>(handler) };
+
+    auto lease = std::make_shared<detail::TransactionLease<decltype(init.handler)>>(options, std::move(init.handler));
+
+    pool(
+          [lease](Connection& conn, auto&& releaseConn) {
+              lease->acquire(conn, std::forward<decltype(releaseConn)>(releaseConn));
+          }
+        , [lease](const boost::system::error_code& ec, const Connection*) {
+              lease->complete(ec);
+          }
+        );
+
+    return init.result.get();
+}
+
+} // namespace asiopq
+} // namespace ba
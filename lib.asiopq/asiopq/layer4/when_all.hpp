@@ -0,0 +1,148 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <vector>
+
+#include "../layer1/cancellation.hpp"
+#include "../layer1/detail/invoke_handler.hpp"
+#include "connection_pool.hpp"
+
+namespace ba {
+namespace asiopq {
+
+enum class WhenAllMode
+{
+    WAIT_ALL,   // дождаться всех операций, ошибка одной не влияет на остальные
+    FIRST_ERROR // первая ошибка отменяет остальные операции
+};
+
+namespace detail {
+
+// Общее состояние операций одного asyncWhenAll, хендлеры пула могут вызываться из разных потоков
+template <typename Handler>
+class WhenAllState
+{
+public:
+    WhenAllState(std::size_t count, WhenAllMode mode, CancellationSlot outer, Handler&& handler)
+        : m_mode{ mode }
+        , m_outer{ std::move(outer) }
+        , m_handler{ std::move(handler) }
+        , m_signals(count)
+        , m_errors(count)
+        , m_remaining{ count }
+    {
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_signals.size();
+    }
+
+    CancellationSlot slot(std::size_t index) const
+    {
+        return m_signals[index].slot();
+    }
+
+    void complete(std::size_t index, const boost::system::error_code& ec)
+    {
+        bool cancel = false;
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock{ m_mutex };
+            m_errors[index] = ec;
+            if (ec && !m_first)
+            {
+                m_first = ec;
+                cancel = WhenAllMode::FIRST_ERROR == m_mode;
+            }
+            last = 0 == --m_remaining;
+        }
+
+        if (cancel)
+            cancelAll();
+
+        if (last)
+        {
+            m_outer.clear();
+            invokeHandler(std::move(m_handler), m_first, std::move(m_errors));
+        }
+    }
+
+    // сигнал уже завершенной операции лишь помечается, повторная отмена безвредна
+    void cancelAll()
+    {
+        for (auto& signal : m_signals)
+            signal.emit();
+    }
+
+private:
+    const WhenAllMode m_mode;
+    const CancellationSlot m_outer;
+    Handler m_handler;
+    std::vector<CancellationSignal> m_signals;
+
+    std::mutex m_mutex;
+    std::vector<boost::system::error_code> m_errors;
+    boost::system::error_code m_first;
+    std::size_t m_remaining;
+};
+
+// Передает каждой операции свой слот отмены и общий срок, submit(index, options, хендлер пула) запускает операцию
+template <typename State, typename Submit>
+void launchWhenAll(const std::shared_ptr<State>& state, RequestOptions&& options, Submit&& submit)
+{
+    if (options.cancellation.connected())
+        options.cancellation.assign([state] { state->cancelAll(); });
+
+    for (std::size_t index = 0; index < state->size(); ++index)
+    {
+        RequestOptions opOptions;
+        opOptions.cancellation = state->slot(index);
+        opOptions.deadline = options.deadline;
+        opOptions.priority = options.priority;
+        opOptions.statement = options.statement;
+
+        submit(index, std::move(opOptions), [state, index](const boost::system::error_code& ec, const Connection*) {
+            state->complete(index, ec);
+        });
+    }
+}
+
+} // namespace detail
+
+// Запускает операции одновременно на разных соединениях пула, время ответа - самая долгая операция, а не сумма.
+// Хендлер: void(const boost::system::error_code& ec, std::vector<boost::system::error_code> errors),
+// ec - первая по времени ошибка, errors[i] - результат ops[i]; данные операции отдают через свои коллекторы.
+// В режиме FIRST_ERROR первая ошибка отменяет остальные (из очереди пула они уходят сразу, выполняющимся
+// отправляется запрос отмены), хендлер вызывается, когда вернутся все: после него коллекторы уже ничего не пишут.
+// options действуют на каждую операцию, отмена через options.cancellation отменяет все.
+// Операций не больше, чем соединений в пуле, иначе лишние ждут в очереди. Без операций хендлер получает пустой errors.
+template <typename Pool, typename Op, typename Handler>
+auto asyncWhenAll(Pool& pool, std::vector<Op> ops, Handler&& handler, WhenAllMode mode = WhenAllMode::WAIT_ALL, RequestOptions options = {})
+{
+    detail::async_result_init<Handler, void(boost::system::error_code, std::vector<boost::system::error_code>)>
+        init{ std::forward<Handler>(handler) };
+
+    if (ops.empty()) // ждать нечего, но хендлер все равно не изнутри вызова
+    {
+        pool.get_io_service().post([handler{ std::move(init.handler) }]() mutable {
+            detail::invokeHandler(std::move(handler), boost::system::error_code{}, std::vector<boost::system::error_code>{});
+        });
+        return init.result.get();
+    }
+
+    using State = detail::WhenAllState<decltype(init.handler)>;
+    detail::launchWhenAll(
+          std::make_shared<State>(ops.size(), mode, options.cancellation, std::move(init.handler))
+        , std::move(options)
+        , [&pool, &ops](std::size_t index, RequestOptions&& opOptions, auto&& complete) {
+              pool(std::move(ops[index]), std::forward<decltype(complete)>(complete), std::move(opOptions));
+          }
+        );
+
+    return init.result.get();
+}
+
+} // namespace asiopq
+} // namespace ba
@@ -0,0 +1 @@
+#include "layer4/lsn_router.hpp"
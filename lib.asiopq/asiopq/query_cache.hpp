@@ -0,0 +1 @@
+#include "layer4/query_cache.hpp"
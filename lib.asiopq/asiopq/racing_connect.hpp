@@ -0,0 +1 @@
+#include "layer3/racing_connect.hpp"
@@ -0,0 +1 @@
+#include "layer3/replication_stream.hpp"
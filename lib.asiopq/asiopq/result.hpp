@@ -0,0 +1 @@
+#include "layer1/result.hpp"
@@ -0,0 +1 @@
+#include "layer3/result_writer.hpp"
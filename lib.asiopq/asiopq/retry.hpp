@@ -0,0 +1 @@
+#include "layer4/retry.hpp"
@@ -0,0 +1 @@
+#include "layer4/sharded_pool.hpp"
@@ -0,0 +1 @@
+#include "layer4/transaction.hpp"
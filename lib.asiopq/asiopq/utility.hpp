@@ -106,6 +106,10 @@ BA_ASIOPQ_DECLARE_COMPOSE_OPERATOR_(&, IfNotError)
 #undef BA_LIBPQ_DECLARE_COMPOSE_OPERATOR_
 
 
+// Операция со стертым типом для пулов. Утилиты, которые сами строят операции для пула (asyncBeginTransaction,
+// BatchWriter, AutoPipeline, QueryCache и т.п.), требуют пул, принимающий произвольную операцию и хендлер:
+// ConnectionPool или ReconnectionPool с PolymorphicOperationType и
+// std::function<void(const boost::system::error_code&, const Connection*)>.
 using PolymorphicOperationType = std::function<void(Connection&, std::function<void(const boost::system::error_code&)>)>;
 
 
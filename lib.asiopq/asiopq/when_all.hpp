@@ -0,0 +1 @@
+#include "layer4/when_all.hpp"